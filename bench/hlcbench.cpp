@@ -0,0 +1,258 @@
+// Compile-time benchmark for libHLC.
+//
+// Usage: hlcbench [-n iterations] [-j max-threads] [-b builtins.bc]
+//                 kernel.ll...
+//
+// For every kernel and OptLevel the parse, builtin link, optimize and
+// HSAIL/BRIG emit phases are timed separately through the C API.  Then the
+// whole corpus is compiled by 1, 2, 4, ... threads (one session each) to
+// show how throughput scales.  Results go to stdout as tab-separated lines
+// whose first field names the record type; progress and errors go to stderr.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+  struct Session;
+  struct ModuleRef;
+
+  void HLC_Initialize();
+  void HLC_Finalize();
+  void HLC_DisposeString(char *str);
+  Session* HLC_CreateSession();
+  void HLC_DestroySession(Session *S);
+  ModuleRef* HLC_SessionParseModule(Session *S, const char *Asm);
+  void HLC_ModuleDestroy(ModuleRef *M);
+  int HLC_SessionLoadBuiltins(Session *S, const char *Bitcode, size_t Len);
+  int HLC_SessionLinkBuiltins(Session *S, ModuleRef *M);
+  int HLC_SessionModuleOptimize(Session *S, ModuleRef *M, int OptLevel,
+                                int SizeLevel, int Verify);
+  int HLC_SessionModuleEmitHSAIL(Session *S, ModuleRef *M, int OptLevel,
+                                 char **output);
+  size_t HLC_SessionModuleEmitBRIG(Session *S, ModuleRef *M, int OptLevel,
+                                   char **output);
+  int HLC_SessionCompile(Session *S, const char *Input, size_t Len,
+                         int OptLevel, int SizeLevel, int Flags, char **HSAIL,
+                         char **BRIG, size_t *BRIGSize);
+}
+
+// Must match CompileFlags in hlc.cpp.
+enum {
+  CompileLinkBuiltins = 1 << 0,
+  CompileEmitHSAIL    = 1 << 1,
+  CompileEmitBRIG     = 1 << 2
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static double SecondsSince(Clock::time_point Start) {
+  return std::chrono::duration<double>(Clock::now() - Start).count();
+}
+
+static bool ReadFile(const char *Path, std::string &Data) {
+  std::ifstream In(Path, std::ios::binary);
+  if (!In) {
+    fprintf(stderr, "hlcbench: cannot read %s\n", Path);
+    return false;
+  }
+  std::ostringstream SS;
+  SS << In.rdbuf();
+  Data = SS.str();
+  return true;
+}
+
+struct Kernel {
+  std::string Name;
+  std::string Source;
+};
+
+struct Sample {
+  std::vector<double> Seconds;
+
+  void add(double S) { Seconds.push_back(S); }
+
+  double median() {
+    std::sort(Seconds.begin(), Seconds.end());
+    return Seconds[Seconds.size() / 2];
+  }
+
+  double min() {
+    return *std::min_element(Seconds.begin(), Seconds.end());
+  }
+};
+
+enum Phase { PhaseParse, PhaseLink, PhaseOptimize, PhaseHSAIL, PhaseBRIG,
+             NumPhases };
+
+static const char *PhaseNames[NumPhases] = {
+  "parse", "link", "optimize", "hsail", "brig"
+};
+
+// Runs one kernel through the module API, timing each phase.
+static bool RunPhases(Session *S, const Kernel &K, int OptLevel,
+                      bool LinkBuiltins, Sample *Samples) {
+  Clock::time_point Start = Clock::now();
+  ModuleRef *M = HLC_SessionParseModule(S, K.Source.c_str());
+  if (!M) return false;
+  Samples[PhaseParse].add(SecondsSince(Start));
+
+  bool Ok = true;
+  if (LinkBuiltins) {
+    Start = Clock::now();
+    Ok = HLC_SessionLinkBuiltins(S, M);
+    Samples[PhaseLink].add(SecondsSince(Start));
+  }
+
+  if (Ok) {
+    Start = Clock::now();
+    Ok = HLC_SessionModuleOptimize(S, M, OptLevel, 0, 0);
+    Samples[PhaseOptimize].add(SecondsSince(Start));
+  }
+
+  // BRIG first, then HSAIL, in the same order HLC_SessionCompile uses.
+  char *Out = nullptr;
+  if (Ok) {
+    Start = Clock::now();
+    Ok = HLC_SessionModuleEmitBRIG(S, M, OptLevel, &Out) != 0;
+    Samples[PhaseBRIG].add(SecondsSince(Start));
+    if (Ok) HLC_DisposeString(Out);
+  }
+
+  if (Ok) {
+    Start = Clock::now();
+    Ok = HLC_SessionModuleEmitHSAIL(S, M, OptLevel, &Out);
+    Samples[PhaseHSAIL].add(SecondsSince(Start));
+    if (Ok) HLC_DisposeString(Out);
+  }
+
+  HLC_ModuleDestroy(M);
+  return Ok;
+}
+
+// Compiles the corpus Rounds times in a private session.
+static void CompileCorpus(const std::vector<Kernel> &Kernels,
+                          const std::string &Builtins, int Rounds,
+                          unsigned &Failures) {
+  Session *S = HLC_CreateSession();
+  int Flags = CompileEmitHSAIL | CompileEmitBRIG;
+  if (!Builtins.empty() &&
+      HLC_SessionLoadBuiltins(S, Builtins.data(), Builtins.size()))
+    Flags |= CompileLinkBuiltins;
+
+  for (int R = 0; R < Rounds; ++R) {
+    for (const Kernel &K : Kernels) {
+      char *HSAIL = nullptr, *BRIG = nullptr;
+      size_t BRIGSize = 0;
+      if (!HLC_SessionCompile(S, K.Source.c_str(), K.Source.size(), 2, 0,
+                              Flags, &HSAIL, &BRIG, &BRIGSize)) {
+        ++Failures;
+        continue;
+      }
+      HLC_DisposeString(HSAIL);
+      HLC_DisposeString(BRIG);
+    }
+  }
+  HLC_DestroySession(S);
+}
+
+static void Usage() {
+  fprintf(stderr, "usage: hlcbench [-n iterations] [-j max-threads] "
+                  "[-b builtins.bc] kernel.ll...\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  int Iterations = 5;
+  unsigned MaxThreads = std::max(1u, std::thread::hardware_concurrency());
+  const char *BuiltinsPath = nullptr;
+  std::vector<Kernel> Kernels;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+      Iterations = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+      MaxThreads = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+      BuiltinsPath = argv[++i];
+    } else if (argv[i][0] == '-') {
+      Usage();
+    } else {
+      Kernel K;
+      if (!ReadFile(argv[i], K.Source)) return 1;
+      const char *Base = strrchr(argv[i], '/');
+      K.Name = Base ? Base + 1 : argv[i];
+      Kernels.push_back(K);
+    }
+  }
+  if (Kernels.empty() || Iterations < 1 || MaxThreads < 1) Usage();
+
+  std::string Builtins;
+  if (BuiltinsPath && !ReadFile(BuiltinsPath, Builtins)) return 1;
+
+  HLC_Initialize();
+  int Status = 0;
+
+  // Phase latency, per kernel and OptLevel.
+  Session *S = HLC_CreateSession();
+  bool LinkBuiltins = !Builtins.empty() &&
+    HLC_SessionLoadBuiltins(S, Builtins.data(), Builtins.size());
+
+  printf("latency\tkernel\topt\tphase\titerations\tmedian_us\tmin_us\n");
+  for (const Kernel &K : Kernels) {
+    for (int OptLevel = 0; OptLevel <= 3; ++OptLevel) {
+      Sample Samples[NumPhases];
+      // One warm-up run so target machine setup is not charged to a phase.
+      Sample Discard[NumPhases];
+      if (!RunPhases(S, K, OptLevel, LinkBuiltins, Discard)) {
+        fprintf(stderr, "hlcbench: %s failed at O%d\n", K.Name.c_str(),
+                OptLevel);
+        Status = 1;
+        continue;
+      }
+      for (int i = 0; i < Iterations; ++i)
+        RunPhases(S, K, OptLevel, LinkBuiltins, Samples);
+      for (int P = 0; P < NumPhases; ++P) {
+        if (Samples[P].Seconds.empty()) continue;
+        printf("latency\t%s\t%d\t%s\t%zu\t%.1f\t%.1f\n", K.Name.c_str(),
+               OptLevel, PhaseNames[P], Samples[P].Seconds.size(),
+               Samples[P].median() * 1e6, Samples[P].min() * 1e6);
+      }
+    }
+  }
+  HLC_DestroySession(S);
+
+  // Throughput as the number of concurrent sessions grows.
+  printf("throughput\tthreads\tcompiles\tseconds\tcompiles_per_s\n");
+  for (unsigned Threads = 1; Threads <= MaxThreads; Threads *= 2) {
+    std::vector<unsigned> Failures(Threads, 0);
+    std::vector<std::thread> Workers;
+    Clock::time_point Start = Clock::now();
+    for (unsigned T = 0; T < Threads; ++T)
+      Workers.push_back(std::thread(CompileCorpus, std::cref(Kernels),
+                                    std::cref(Builtins), Iterations,
+                                    std::ref(Failures[T])));
+    for (std::thread &W : Workers)
+      W.join();
+    double Seconds = SecondsSince(Start);
+
+    size_t Compiles = Threads * Iterations * Kernels.size();
+    for (unsigned F : Failures) {
+      Compiles -= F;
+      if (F) Status = 1;
+    }
+    printf("throughput\t%u\t%zu\t%.3f\t%.1f\n", Threads, Compiles, Seconds,
+           Compiles / Seconds);
+    fflush(stdout);
+  }
+
+  HLC_Finalize();
+  return Status;
+}
@@ -0,0 +1,248 @@
+// Concurrency stress test for the libHLC module API.
+//
+// Usage: hlcstress [-n rounds] [-j max-threads] [-b builtins.bc] kernel.ll...
+//
+// Every compile parses a kernel, links the builtins into it (with
+// HLC_SessionModuleLinkIn from a fresh parse of builtins.bc, or the embedded
+// builtins without -b), optimizes it at O2 and emits BRIG.  The corpus is
+// first compiled on one thread to get reference BRIG, then by 1, 2, 4, ...
+// threads up to the core count, each thread in its own session and doing
+// every kernel Rounds times.  For each thread count it reports throughput,
+// p50/p99 compile latency, CPU utilization and voluntary context switches
+// (threads blocking on a lock show up as low utilization and many switches),
+// and how many outputs differ from the reference.  Results go to stdout as
+// tab-separated lines; the exit status is 1 on any failure or mismatch.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <thread>
+#include <vector>
+
+extern "C" {
+  struct Session;
+  struct ModuleRef;
+
+  void HLC_Initialize();
+  void HLC_Finalize();
+  void HLC_DisposeString(char *str);
+  Session* HLC_CreateSession();
+  void HLC_DestroySession(Session *S);
+  ModuleRef* HLC_SessionParseModule(Session *S, const char *Asm);
+  ModuleRef* HLC_SessionParseBitcodeLazy(Session *S, const char *Bitcode,
+                                         size_t Len);
+  void HLC_ModuleDestroy(ModuleRef *M);
+  int HLC_SessionModuleLinkIn(Session *S, ModuleRef *Dst, ModuleRef *Src);
+  int HLC_SessionLinkBuiltins(Session *S, ModuleRef *M);
+  int HLC_SessionModuleOptimize(Session *S, ModuleRef *M, int OptLevel,
+                                int SizeLevel, int Verify);
+  size_t HLC_SessionModuleEmitBRIG(Session *S, ModuleRef *M, int OptLevel,
+                                   char **output);
+}
+
+typedef std::chrono::steady_clock Clock;
+
+static const int OptLevel = 2;
+
+static double SecondsSince(Clock::time_point Start) {
+  return std::chrono::duration<double>(Clock::now() - Start).count();
+}
+
+static bool ReadFile(const char *Path, std::string &Data) {
+  std::ifstream In(Path, std::ios::binary);
+  if (!In) {
+    fprintf(stderr, "hlcstress: cannot read %s\n", Path);
+    return false;
+  }
+  std::ostringstream SS;
+  SS << In.rdbuf();
+  Data = SS.str();
+  return true;
+}
+
+struct Kernel {
+  std::string Name;
+  std::string Source;
+  std::string Reference; // BRIG from the single-threaded run
+};
+
+// Compiles K in S through the module API.  Returns false on failure.
+static bool Compile(Session *S, const Kernel &K, const std::string &Builtins,
+                    std::string &BRIG) {
+  ModuleRef *M = HLC_SessionParseModule(S, K.Source.c_str());
+  if (!M) return false;
+
+  bool Ok;
+  if (Builtins.empty()) {
+    Ok = HLC_SessionLinkBuiltins(S, M);
+  } else {
+    ModuleRef *Lib = HLC_SessionParseBitcodeLazy(S, Builtins.data(),
+                                                 Builtins.size());
+    Ok = Lib && HLC_SessionModuleLinkIn(S, M, Lib);
+    if (Lib) HLC_ModuleDestroy(Lib);
+  }
+
+  Ok = Ok && HLC_SessionModuleOptimize(S, M, OptLevel, 0, 0);
+
+  char *Out = nullptr;
+  size_t Len = 0;
+  if (Ok) {
+    Len = HLC_SessionModuleEmitBRIG(S, M, OptLevel, &Out);
+    Ok = Len != 0;
+  }
+  if (Ok) {
+    BRIG.assign(Out, Len);
+    HLC_DisposeString(Out);
+  }
+  HLC_ModuleDestroy(M);
+  return Ok;
+}
+
+struct WorkerResult {
+  std::vector<double> Latencies;
+  unsigned Failures = 0;
+  unsigned Mismatches = 0;
+};
+
+// Compiles every kernel Rounds times in a private session, checking each
+// output against the reference.  The threads start together on Go.
+static void Worker(const std::vector<Kernel> &Kernels,
+                   const std::string &Builtins, int Rounds,
+                   const std::atomic<bool> &Go, WorkerResult &Result) {
+  Session *S = HLC_CreateSession();
+  while (!Go)
+    std::this_thread::yield();
+
+  std::string BRIG;
+  for (int R = 0; R < Rounds; ++R) {
+    for (const Kernel &K : Kernels) {
+      Clock::time_point Start = Clock::now();
+      if (!Compile(S, K, Builtins, BRIG)) {
+        ++Result.Failures;
+        continue;
+      }
+      Result.Latencies.push_back(SecondsSince(Start));
+      if (BRIG != K.Reference)
+        ++Result.Mismatches;
+    }
+  }
+  HLC_DestroySession(S);
+}
+
+static double Percentile(std::vector<double> &Sorted, double P) {
+  if (Sorted.empty()) return 0;
+  size_t Index = std::min(Sorted.size() - 1,
+                          static_cast<size_t>(P * Sorted.size()));
+  return Sorted[Index];
+}
+
+static double CPUSeconds(const struct rusage &U) {
+  return U.ru_utime.tv_sec + U.ru_stime.tv_sec +
+         (U.ru_utime.tv_usec + U.ru_stime.tv_usec) * 1e-6;
+}
+
+static void Usage() {
+  fprintf(stderr, "usage: hlcstress [-n rounds] [-j max-threads] "
+                  "[-b builtins.bc] kernel.ll...\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  int Rounds = 5;
+  unsigned MaxThreads = std::max(1u, std::thread::hardware_concurrency());
+  const char *BuiltinsPath = nullptr;
+  std::vector<Kernel> Kernels;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+      Rounds = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+      MaxThreads = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+      BuiltinsPath = argv[++i];
+    } else if (argv[i][0] == '-') {
+      Usage();
+    } else {
+      Kernel K;
+      if (!ReadFile(argv[i], K.Source)) return 1;
+      const char *Base = strrchr(argv[i], '/');
+      K.Name = Base ? Base + 1 : argv[i];
+      Kernels.push_back(K);
+    }
+  }
+  if (Kernels.empty() || Rounds < 1 || MaxThreads < 1) Usage();
+
+  std::string Builtins;
+  if (BuiltinsPath && !ReadFile(BuiltinsPath, Builtins)) return 1;
+
+  HLC_Initialize();
+  int Status = 0;
+
+  // Reference outputs from one thread.
+  Session *S = HLC_CreateSession();
+  for (Kernel &K : Kernels) {
+    if (!Compile(S, K, Builtins, K.Reference)) {
+      fprintf(stderr, "hlcstress: %s failed to compile\n", K.Name.c_str());
+      HLC_DestroySession(S);
+      HLC_Finalize();
+      return 1;
+    }
+  }
+  HLC_DestroySession(S);
+
+  std::vector<unsigned> ThreadCounts;
+  for (unsigned Threads = 1; Threads < MaxThreads; Threads *= 2)
+    ThreadCounts.push_back(Threads);
+  ThreadCounts.push_back(MaxThreads);
+
+  printf("stress\tthreads\tcompiles\tseconds\tcompiles_per_s\tp50_us\t"
+         "p99_us\tcpu_util\tvoluntary_csw\tfailures\tmismatches\n");
+  for (unsigned Threads : ThreadCounts) {
+    std::vector<WorkerResult> Results(Threads);
+    std::vector<std::thread> Workers;
+    std::atomic<bool> Go(false);
+    for (unsigned T = 0; T < Threads; ++T)
+      Workers.push_back(std::thread(Worker, std::cref(Kernels),
+                                    std::cref(Builtins), Rounds,
+                                    std::cref(Go), std::ref(Results[T])));
+
+    struct rusage Before, After;
+    getrusage(RUSAGE_SELF, &Before);
+    Clock::time_point Start = Clock::now();
+    Go = true;
+    for (std::thread &W : Workers)
+      W.join();
+    double Seconds = SecondsSince(Start);
+    getrusage(RUSAGE_SELF, &After);
+
+    std::vector<double> Latencies;
+    unsigned Failures = 0, Mismatches = 0;
+    for (WorkerResult &R : Results) {
+      Latencies.insert(Latencies.end(), R.Latencies.begin(),
+                       R.Latencies.end());
+      Failures += R.Failures;
+      Mismatches += R.Mismatches;
+    }
+    std::sort(Latencies.begin(), Latencies.end());
+    if (Failures || Mismatches) Status = 1;
+
+    double Utilization = (CPUSeconds(After) - CPUSeconds(Before)) /
+                         (Seconds * Threads);
+    printf("stress\t%u\t%zu\t%.3f\t%.1f\t%.1f\t%.1f\t%.2f\t%ld\t%u\t%u\n",
+           Threads, Latencies.size(), Seconds, Latencies.size() / Seconds,
+           Percentile(Latencies, 0.50) * 1e6,
+           Percentile(Latencies, 0.99) * 1e6, Utilization,
+           After.ru_nvcsw - Before.ru_nvcsw, Failures, Mismatches);
+    fflush(stdout);
+  }
+
+  HLC_Finalize();
+  return Status;
+}
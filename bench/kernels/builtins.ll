@@ -0,0 +1,87 @@
+; Math-heavy kernel calling many builtins, so linking and inlining dominate.
+target datalayout = "e-i64:64-v16:16-v24:32-v32:32-v48:64-v96:128-v192:256-v256:256-v512:512-v1024:1024-n32"
+target triple = "hsail64-pc-unknown-amdopencl"
+
+define spir_kernel void @transcendental(float addrspace(1)* %in,
+                                        float addrspace(1)* %out) {
+entry:
+  %gid = call spir_func i64 @_Z13get_global_idj(i32 0)
+  %pi = getelementptr inbounds float addrspace(1)* %in, i64 %gid
+  %x = load float addrspace(1)* %pi, align 4
+  %ax = call spir_func float @_Z4fabsf(float %x)
+  %sq = call spir_func float @_Z4sqrtf(float %ax)
+  %rs = call spir_func float @_Z5rsqrtf(float %ax)
+  %ex = call spir_func float @_Z3expf(float %x)
+  %lg = call spir_func float @_Z3logf(float %ex)
+  %sn = call spir_func float @_Z3sinf(float %x)
+  %cs = call spir_func float @_Z3cosf(float %x)
+  %pw = call spir_func float @_Z3powff(float %ax, float 1.500000e+00)
+  %t0 = fadd float %sq, %rs
+  %t1 = fadd float %lg, %pw
+  %t2 = fmul float %sn, %cs
+  %t3 = fadd float %t0, %t1
+  %t4 = fadd float %t3, %t2
+  %po = getelementptr inbounds float addrspace(1)* %out, i64 %gid
+  store float %t4, float addrspace(1)* %po, align 4
+  ret void
+}
+
+; Black-Scholes style option pricing: exp/log/sqrt on a straight line.
+define spir_kernel void @black_scholes(float addrspace(1)* %spot,
+                                       float addrspace(1)* %strike,
+                                       float addrspace(1)* %call,
+                                       float %rate, float %vol, float %t) {
+entry:
+  %gid = call spir_func i64 @_Z13get_global_idj(i32 0)
+  %ps = getelementptr inbounds float addrspace(1)* %spot, i64 %gid
+  %pk = getelementptr inbounds float addrspace(1)* %strike, i64 %gid
+  %s = load float addrspace(1)* %ps, align 4
+  %k = load float addrspace(1)* %pk, align 4
+  %sqrtt = call spir_func float @_Z4sqrtf(float %t)
+  %ratio = fdiv float %s, %k
+  %lnr = call spir_func float @_Z3logf(float %ratio)
+  %vv = fmul float %vol, %vol
+  %hvv = fmul float %vv, 5.000000e-01
+  %drift = fadd float %rate, %hvv
+  %dt = fmul float %drift, %t
+  %num = fadd float %lnr, %dt
+  %den = fmul float %vol, %sqrtt
+  %d1 = fdiv float %num, %den
+  %d2 = fsub float %d1, %den
+  %n1 = call spir_func float @cnd(float %d1)
+  %n2 = call spir_func float @cnd(float %d2)
+  %nrt = fmul float %rate, %t
+  %mrt = fsub float -0.000000e+00, %nrt
+  %disc = call spir_func float @_Z3expf(float %mrt)
+  %a = fmul float %s, %n1
+  %kd = fmul float %k, %disc
+  %b = fmul float %kd, %n2
+  %c = fsub float %a, %b
+  %pc = getelementptr inbounds float addrspace(1)* %call, i64 %gid
+  store float %c, float addrspace(1)* %pc, align 4
+  ret void
+}
+
+; Logistic approximation of the standard normal CDF.
+define internal spir_func float @cnd(float %d) {
+entry:
+  %scaled = fmul float %d, 0xBFFB3B6460000000
+  %e = call spir_func float @_Z3expf(float %scaled)
+  %den = fadd float %e, 1.000000e+00
+  %r = fdiv float 1.000000e+00, %den
+  ret float %r
+}
+
+declare spir_func i64 @_Z13get_global_idj(i32)
+declare spir_func float @_Z4fabsf(float)
+declare spir_func float @_Z4sqrtf(float)
+declare spir_func float @_Z5rsqrtf(float)
+declare spir_func float @_Z3expf(float)
+declare spir_func float @_Z3logf(float)
+declare spir_func float @_Z3sinf(float)
+declare spir_func float @_Z3cosf(float)
+declare spir_func float @_Z3powff(float, float)
+
+!opencl.kernels = !{!0, !1}
+!0 = !{void (float addrspace(1)*, float addrspace(1)*)* @transcendental}
+!1 = !{void (float addrspace(1)*, float addrspace(1)*, float addrspace(1)*, float, float, float)* @black_scholes}
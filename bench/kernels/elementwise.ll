@@ -0,0 +1,42 @@
+; Elementwise kernels: one work-item per element, no control flow.
+target datalayout = "e-i64:64-v16:16-v24:32-v32:32-v48:64-v96:128-v192:256-v256:256-v512:512-v1024:1024-n32"
+target triple = "hsail64-pc-unknown-amdopencl"
+
+define spir_kernel void @saxpy(float %a, float addrspace(1)* %x,
+                               float addrspace(1)* %y,
+                               float addrspace(1)* %out) {
+entry:
+  %gid = call spir_func i64 @_Z13get_global_idj(i32 0)
+  %px = getelementptr inbounds float addrspace(1)* %x, i64 %gid
+  %py = getelementptr inbounds float addrspace(1)* %y, i64 %gid
+  %vx = load float addrspace(1)* %px, align 4
+  %vy = load float addrspace(1)* %py, align 4
+  %ax = fmul float %a, %vx
+  %r = fadd float %ax, %vy
+  %po = getelementptr inbounds float addrspace(1)* %out, i64 %gid
+  store float %r, float addrspace(1)* %po, align 4
+  ret void
+}
+
+define spir_kernel void @clamp_scale(float addrspace(1)* %in,
+                                     float addrspace(1)* %out,
+                                     float %scale, float %lo, float %hi) {
+entry:
+  %gid = call spir_func i64 @_Z13get_global_idj(i32 0)
+  %pi = getelementptr inbounds float addrspace(1)* %in, i64 %gid
+  %v = load float addrspace(1)* %pi, align 4
+  %s = fmul float %v, %scale
+  %lt = fcmp olt float %s, %lo
+  %c0 = select i1 %lt, float %lo, float %s
+  %gt = fcmp ogt float %c0, %hi
+  %c1 = select i1 %gt, float %hi, float %c0
+  %po = getelementptr inbounds float addrspace(1)* %out, i64 %gid
+  store float %c1, float addrspace(1)* %po, align 4
+  ret void
+}
+
+declare spir_func i64 @_Z13get_global_idj(i32)
+
+!opencl.kernels = !{!0, !1}
+!0 = !{void (float, float addrspace(1)*, float addrspace(1)*, float addrspace(1)*)* @saxpy}
+!1 = !{void (float addrspace(1)*, float addrspace(1)*, float, float, float)* @clamp_scale}
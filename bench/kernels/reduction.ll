@@ -0,0 +1,103 @@
+; Work-group tree reduction through local memory, one partial sum per group.
+target datalayout = "e-i64:64-v16:16-v24:32-v32:32-v48:64-v96:128-v192:256-v256:256-v512:512-v1024:1024-n32"
+target triple = "hsail64-pc-unknown-amdopencl"
+
+@reduce_sum.scratch = internal addrspace(3) global [256 x float] undef, align 4
+
+define spir_kernel void @reduce_sum(float addrspace(1)* %in,
+                                    float addrspace(1)* %partial, i64 %n) {
+entry:
+  %gid = call spir_func i64 @_Z13get_global_idj(i32 0)
+  %lid = call spir_func i64 @_Z12get_local_idj(i32 0)
+  %lsize = call spir_func i64 @_Z14get_local_sizej(i32 0)
+  %inrange = icmp ult i64 %gid, %n
+  br i1 %inrange, label %load, label %fill
+
+load:
+  %pi = getelementptr inbounds float addrspace(1)* %in, i64 %gid
+  %v = load float addrspace(1)* %pi, align 4
+  br label %fill
+
+fill:
+  %init = phi float [ %v, %load ], [ 0.000000e+00, %entry ]
+  %slot = getelementptr inbounds [256 x float] addrspace(3)* @reduce_sum.scratch, i64 0, i64 %lid
+  store float %init, float addrspace(3)* %slot, align 4
+  call spir_func void @_Z7barrierj(i32 1)
+  %half0 = lshr i64 %lsize, 1
+  br label %loop.cond
+
+loop.cond:
+  %stride = phi i64 [ %half0, %fill ], [ %stride.next, %loop.latch ]
+  %more = icmp ne i64 %stride, 0
+  br i1 %more, label %loop.body, label %done
+
+loop.body:
+  %active = icmp ult i64 %lid, %stride
+  br i1 %active, label %accumulate, label %loop.latch
+
+accumulate:
+  %other = add i64 %lid, %stride
+  %pother = getelementptr inbounds [256 x float] addrspace(3)* @reduce_sum.scratch, i64 0, i64 %other
+  %a = load float addrspace(3)* %slot, align 4
+  %b = load float addrspace(3)* %pother, align 4
+  %sum = fadd float %a, %b
+  store float %sum, float addrspace(3)* %slot, align 4
+  br label %loop.latch
+
+loop.latch:
+  call spir_func void @_Z7barrierj(i32 1)
+  %stride.next = lshr i64 %stride, 1
+  br label %loop.cond
+
+done:
+  %first = icmp eq i64 %lid, 0
+  br i1 %first, label %write, label %exit
+
+write:
+  %group = call spir_func i64 @_Z12get_group_idj(i32 0)
+  %total = load float addrspace(3)* getelementptr inbounds ([256 x float] addrspace(3)* @reduce_sum.scratch, i64 0, i64 0), align 4
+  %pp = getelementptr inbounds float addrspace(1)* %partial, i64 %group
+  store float %total, float addrspace(1)* %pp, align 4
+  br label %exit
+
+exit:
+  ret void
+}
+
+; Serial per-item reduction over a row, exercising loop optimizations.
+define spir_kernel void @row_max(float addrspace(1)* %in,
+                                 float addrspace(1)* %out, i64 %cols) {
+entry:
+  %row = call spir_func i64 @_Z13get_global_idj(i32 0)
+  %base = mul i64 %row, %cols
+  %empty = icmp eq i64 %cols, 0
+  br i1 %empty, label %exit, label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %m = phi float [ 0xFFF0000000000000, %entry ], [ %m.next, %loop ]
+  %idx = add i64 %base, %i
+  %p = getelementptr inbounds float addrspace(1)* %in, i64 %idx
+  %v = load float addrspace(1)* %p, align 4
+  %m.next = call spir_func float @_Z4fmaxff(float %m, float %v)
+  %i.next = add i64 %i, 1
+  %cont = icmp ult i64 %i.next, %cols
+  br i1 %cont, label %loop, label %exit
+
+exit:
+  %r = phi float [ 0xFFF0000000000000, %entry ], [ %m.next, %loop ]
+  %po = getelementptr inbounds float addrspace(1)* %out, i64 %row
+  store float %r, float addrspace(1)* %po, align 4
+  ret void
+}
+
+declare spir_func i64 @_Z13get_global_idj(i32)
+declare spir_func i64 @_Z12get_local_idj(i32)
+declare spir_func i64 @_Z14get_local_sizej(i32)
+declare spir_func i64 @_Z12get_group_idj(i32)
+declare spir_func void @_Z7barrierj(i32)
+declare spir_func float @_Z4fmaxff(float, float)
+
+!opencl.kernels = !{!0, !1}
+!0 = !{void (float addrspace(1)*, float addrspace(1)*, i64)* @reduce_sum}
+!1 = !{void (float addrspace(1)*, float addrspace(1)*, i64)* @row_max}
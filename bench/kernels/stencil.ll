@@ -0,0 +1,92 @@
+; 2D five-point stencil (Jacobi step) over the interior of a grid.
+target datalayout = "e-i64:64-v16:16-v24:32-v32:32-v48:64-v96:128-v192:256-v256:256-v512:512-v1024:1024-n32"
+target triple = "hsail64-pc-unknown-amdopencl"
+
+define spir_kernel void @jacobi5(float addrspace(1)* %in,
+                                 float addrspace(1)* %out,
+                                 i64 %width, i64 %height) {
+entry:
+  %x = call spir_func i64 @_Z13get_global_idj(i32 0)
+  %y = call spir_func i64 @_Z13get_global_idj(i32 1)
+  %x0 = icmp eq i64 %x, 0
+  %y0 = icmp eq i64 %y, 0
+  %w1 = add i64 %width, -1
+  %h1 = add i64 %height, -1
+  %xe = icmp uge i64 %x, %w1
+  %ye = icmp uge i64 %y, %h1
+  %b0 = or i1 %x0, %y0
+  %b1 = or i1 %xe, %ye
+  %border = or i1 %b0, %b1
+  br i1 %border, label %exit, label %interior
+
+interior:
+  %row = mul i64 %y, %width
+  %c = add i64 %row, %x
+  %l = add i64 %c, -1
+  %r = add i64 %c, 1
+  %u = sub i64 %c, %width
+  %d = add i64 %c, %width
+  %pc = getelementptr inbounds float addrspace(1)* %in, i64 %c
+  %pl = getelementptr inbounds float addrspace(1)* %in, i64 %l
+  %pr = getelementptr inbounds float addrspace(1)* %in, i64 %r
+  %pu = getelementptr inbounds float addrspace(1)* %in, i64 %u
+  %pd = getelementptr inbounds float addrspace(1)* %in, i64 %d
+  %vc = load float addrspace(1)* %pc, align 4
+  %vl = load float addrspace(1)* %pl, align 4
+  %vr = load float addrspace(1)* %pr, align 4
+  %vu = load float addrspace(1)* %pu, align 4
+  %vd = load float addrspace(1)* %pd, align 4
+  %s0 = fadd float %vl, %vr
+  %s1 = fadd float %vu, %vd
+  %s2 = fadd float %s0, %s1
+  %s3 = fmul float %vc, 4.000000e+00
+  %s4 = fadd float %s2, %s3
+  %res = fmul float %s4, 1.250000e-01
+  %po = getelementptr inbounds float addrspace(1)* %out, i64 %c
+  store float %res, float addrspace(1)* %po, align 4
+  br label %exit
+
+exit:
+  ret void
+}
+
+; Horizontal box blur with a radius loop the unroller can chew on.
+define spir_kernel void @box_blur_x(float addrspace(1)* %in,
+                                    float addrspace(1)* %out,
+                                    i64 %width) {
+entry:
+  %x = call spir_func i64 @_Z13get_global_idj(i32 0)
+  %y = call spir_func i64 @_Z13get_global_idj(i32 1)
+  %row = mul i64 %y, %width
+  br label %loop
+
+loop:
+  %k = phi i64 [ -4, %entry ], [ %k.next, %loop ]
+  %acc = phi float [ 0.000000e+00, %entry ], [ %acc.next, %loop ]
+  %xs = add i64 %x, %k
+  %neg = icmp slt i64 %xs, 0
+  %xc0 = select i1 %neg, i64 0, i64 %xs
+  %over = icmp sge i64 %xc0, %width
+  %wm1 = add i64 %width, -1
+  %xc = select i1 %over, i64 %wm1, i64 %xc0
+  %idx = add i64 %row, %xc
+  %p = getelementptr inbounds float addrspace(1)* %in, i64 %idx
+  %v = load float addrspace(1)* %p, align 4
+  %acc.next = fadd float %acc, %v
+  %k.next = add i64 %k, 1
+  %cont = icmp sle i64 %k.next, 4
+  br i1 %cont, label %loop, label %exit
+
+exit:
+  %avg = fmul float %acc.next, 0x3FBC71C720000000
+  %oidx = add i64 %row, %x
+  %po = getelementptr inbounds float addrspace(1)* %out, i64 %oidx
+  store float %avg, float addrspace(1)* %po, align 4
+  ret void
+}
+
+declare spir_func i64 @_Z13get_global_idj(i32)
+
+!opencl.kernels = !{!0, !1}
+!0 = !{void (float addrspace(1)*, float addrspace(1)*, i64, i64)* @jacobi5}
+!1 = !{void (float addrspace(1)*, float addrspace(1)*, i64)* @box_blur_x}
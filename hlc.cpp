@@ -1,19 +1,29 @@
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/Triple.h"
 #include "llvm/CodeGen/CommandFlags.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/CodeGen/LinkAllAsmWriterComponents.h"
 #include "llvm/CodeGen/LinkAllCodegenComponents.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/CallSite.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/IRPrintingPasses.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IRReader/IRReader.h"
 #include "llvm/MC/SubtargetFeature.h"
 #include "llvm/Pass.h"
 #include "llvm/PassManager.h"
+#include "llvm/Support/Allocator.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/FormattedStream.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/Host.h"
 #include "llvm/Support/ManagedStatic.h"
 #include "llvm/Support/PluginLoader.h"
@@ -22,6 +32,8 @@
 #include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/TimeValue.h"
+#include "llvm/Support/Timer.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Target/TargetLibraryInfo.h"
 #include "llvm/Target/TargetMachine.h"
@@ -38,18 +50,28 @@
 #include "llvm/LinkAllPasses.h"
 #include "llvm/Support/SystemUtils.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/AsmParser/Parser.h"
 #include "llvm/Linker/Linker.h"
 #include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/IR/DiagnosticPrinter.h"
 #include "llvm/Bitcode/ReaderWriter.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <stdio.h>
+#include <unistd.h>
 
 namespace libHLC {
 
-static llvm::LLVMContext *TheContext = nullptr;
-
 bool DisableInline = false;
 bool UnitAtATime = true;
 bool DisableLoopVectorization = false;
@@ -58,6 +80,8 @@ bool StripDebug = false;
 bool DisableOptimizations = false;
 bool DisableSimplifyLibCalls = false;
 
+class Session;
+
 class ModuleRef {
 public:
   ModuleRef(Module * module) : M(module) { }
@@ -68,31 +92,46 @@ public:
 
   Module * get() { return M; }
 
+  // The session that destroys this module if the caller doesn't.
+  Session *getOwner() const { return Owner; }
+  void setOwner(Session *S) { Owner = S; }
+
   void destroy() {
     delete M;
     M = nullptr;
   }
 
+  // Reads any function bodies that are still lazily loaded.
+  bool materialize() {
+    if (std::error_code EC = M->materializeAll()) {
+      errs() << EC.message() << "\n";
+      return false;
+    }
+    return true;
+  }
+
   std::string to_string() {
       std::string buf;
       raw_string_ostream os(buf);
+      materialize();
       M->print(os, nullptr);
       os.flush();
       return buf;
   }
 
-    static ModuleRef* parseAssembly(const char* Asm) {
+    static ModuleRef* parseAssembly(const char* Asm, LLVMContext &Context) {
       SMDiagnostic SM;
-      Module* M = parseAssemblyString(Asm, SM, *TheContext).release();
+      Module* M = parseAssemblyString(Asm, SM, Context).release();
       if (!M) return nullptr;
       return new ModuleRef(M);
     }
 
-    static ModuleRef* parseBitcode(const char *Bitcode, size_t Len) {
+    static ModuleRef* parseBitcode(const char *Bitcode, size_t Len,
+                                   LLVMContext &Context) {
       auto buf = MemoryBuffer::getMemBuffer(StringRef(Bitcode, Len),
                                             "", false);
       ErrorOr<Module *> ModuleOrErr =
-            parseBitcodeFile(buf->getMemBufferRef(), *TheContext);
+            parseBitcodeFile(buf->getMemBufferRef(), Context);
       if (std::error_code EC = ModuleOrErr.getError()) {
         puts(EC.message().c_str());
         return nullptr;
@@ -102,371 +141,3585 @@ public:
       return new ModuleRef(ModuleOrErr.get());
   }
 
+    // Like parseBitcode, but function bodies are left in the bitcode until
+    // they are needed.  The bitcode is copied since the module outlives it.
+    static ModuleRef* parseBitcodeLazy(const char *Bitcode, size_t Len,
+                                       LLVMContext &Context) {
+      auto buf = MemoryBuffer::getMemBufferCopy(StringRef(Bitcode, Len), "");
+      ErrorOr<Module *> ModuleOrErr =
+            getLazyBitcodeModule(std::move(buf), Context);
+      if (std::error_code EC = ModuleOrErr.getError()) {
+        puts(EC.message().c_str());
+        return nullptr;
+      }
+      return new ModuleRef(ModuleOrErr.get());
+  }
+
 private:
   Module* M;
+  Session *Owner = nullptr;
 };
 
-CodeGenOpt::Level GetCodeGenOptLevel(int OptLevel) {
-  switch (OptLevel) {
-  case 1:
-    return CodeGenOpt::Less;
-  case 2:
-    return CodeGenOpt::Default;
-  case 3:
-    return CodeGenOpt::Aggressive;
-  default:
-    return CodeGenOpt::None;
+// Parses Bitcode as a lazily materialized module.  The bitcode is not copied,
+// so it must stay alive for as long as the module can still materialize.
+static Module *ParseLazyBitcode(StringRef Bitcode, LLVMContext &Context,
+                                std::string &Error) {
+  auto Buf = MemoryBuffer::getMemBuffer(Bitcode, "", false);
+  ErrorOr<Module *> ModuleOrErr = getLazyBitcodeModule(std::move(Buf), Context);
+  if (std::error_code EC = ModuleOrErr.getError()) {
+    Error = EC.message();
+    return nullptr;
   }
+  return ModuleOrErr.get();
 }
 
-//// Borrowed from LLVM opt.cpp
-/// This routine adds optimization passes based on selected optimization level,
-/// OptLevel.
-///
-/// OptLevel - Optimization Level
-static void AddOptimizationPasses(PassManagerBase &MPM,FunctionPassManager &FPM,
-                                  unsigned OptLevel, unsigned SizeLevel) {
-  FPM.add(createVerifierPass());          // Verify that input is correct
-  MPM.add(createDebugInfoVerifierPass()); // Verify that debug info is correct
-
-  PassManagerBuilder Builder;
-  Builder.OptLevel = OptLevel;
-  Builder.SizeLevel = SizeLevel;
+// Adds the global values used by V to Worklist if they aren't in Live yet.
+static void CollectGlobalRefs(Value *V, SmallPtrSetImpl<GlobalValue *> &Live,
+                              SmallPtrSetImpl<Constant *> &Visited,
+                              SmallVectorImpl<GlobalValue *> &Worklist) {
+  if (GlobalValue *GV = dyn_cast<GlobalValue>(V)) {
+    if (Live.insert(GV).second)
+      Worklist.push_back(GV);
+    return;
+  }
+  Constant *C = dyn_cast<Constant>(V);
+  if (!C || !Visited.insert(C).second)
+    return;
+  for (Use &Op : C->operands())
+    CollectGlobalRefs(Op.get(), Live, Visited, Worklist);
+}
 
-  if (DisableInline) {
-    // No inlining pass
-  } else if (OptLevel > 1) {
-    Builder.Inliner = createFunctionInliningPass(OptLevel, SizeLevel);
-  } else {
-    Builder.Inliner = createAlwaysInlinerPass();
+// Adds everything reachable from the values on Worklist to Live, reading
+// lazily loaded bodies as they are reached.
+static std::error_code
+CollectReachable(SmallPtrSetImpl<GlobalValue *> &Live,
+                 SmallVectorImpl<GlobalValue *> &Worklist) {
+  SmallPtrSet<Constant *, 64> Visited;
+  while (!Worklist.empty()) {
+    GlobalValue *GV = Worklist.pop_back_val();
+    if (GV->isMaterializable())
+      if (std::error_code EC = GV->getParent()->materialize(GV))
+        return EC;
+
+    if (Function *F = dyn_cast<Function>(GV)) {
+      for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I)
+        for (Use &Op : I->operands())
+          CollectGlobalRefs(Op.get(), Live, Visited, Worklist);
+    } else if (GlobalVariable *Var = dyn_cast<GlobalVariable>(GV)) {
+      if (Var->hasInitializer())
+        CollectGlobalRefs(Var->getInitializer(), Live, Visited, Worklist);
+    } else if (GlobalAlias *GA = dyn_cast<GlobalAlias>(GV)) {
+      CollectGlobalRefs(GA->getAliasee(), Live, Visited, Worklist);
+    }
   }
-  Builder.DisableUnitAtATime = !UnitAtATime;
-  // Builder.DisableUnrollLoops = (DisableLoopUnrolling.getNumOccurrences() > 0) ?
-  //                              DisableLoopUnrolling : OptLevel == 0;
-  Builder.DisableUnrollLoops = OptLevel == 0;
+  return std::error_code();
+}
 
-  // This is final, unless there is a #pragma vectorize enable
-  if (DisableLoopVectorization)
-    Builder.LoopVectorize = false;
-  // If option wasn't forced via cmd line (-vectorize-loops, -loop-vectorize)
-  else if (!Builder.LoopVectorize)
-    Builder.LoopVectorize = OptLevel > 1 && SizeLevel < 2;
+// Deletes the global values in Dead, which may refer to each other.
+static void EraseGlobalValues(ArrayRef<GlobalValue *> Dead) {
+  // Drop all references first so that dead values don't keep each other alive.
+  for (GlobalValue *GV : Dead) {
+    if (Function *F = dyn_cast<Function>(GV))
+      F->deleteBody();
+    else if (GlobalVariable *Var = dyn_cast<GlobalVariable>(GV))
+      Var->setInitializer(nullptr);
+    else
+      GV->dropAllReferences();
+  }
+  for (GlobalValue *GV : Dead) {
+    if (!GV->use_empty())
+      GV->replaceAllUsesWith(UndefValue::get(GV->getType()));
+    GV->eraseFromParent();
+  }
+}
 
-  // When #pragma vectorize is on for SLP, do the same as above
-  Builder.SLPVectorize =
-      DisableSLPVectorization ? false : OptLevel > 1 && SizeLevel < 2;
+// Replaces everything M defines and declares with the contents of Src, a
+// clone of M in the same context without comdats, leaving Src empty.
+static void ReplaceModuleContents(Module *M, Module *Src) {
+  std::vector<GlobalValue *> Old;
+  for (Module::iterator F = M->begin(), E = M->end(); F != E; ++F)
+    Old.push_back(F);
+  for (Module::global_iterator G = M->global_begin(), E = M->global_end();
+       G != E; ++G)
+    Old.push_back(G);
+  for (Module::alias_iterator A = M->alias_begin(), E = M->alias_end();
+       A != E; ++A)
+    Old.push_back(A);
+  EraseGlobalValues(Old);
+  while (M->named_metadata_begin() != M->named_metadata_end())
+    M->eraseNamedMetadata(M->named_metadata_begin());
+
+  // Moving the values updates their parent and M's symbol table.
+  M->getFunctionList().splice(M->end(), Src->getFunctionList());
+  M->getGlobalList().splice(M->global_end(), Src->getGlobalList());
+  M->getAliasList().splice(M->alias_end(), Src->getAliasList());
+  for (Module::named_metadata_iterator I = Src->named_metadata_begin(),
+       E = Src->named_metadata_end(); I != E; ++I) {
+    NamedMDNode *N = M->getOrInsertNamedMetadata(I->getName());
+    for (unsigned i = 0, e = I->getNumOperands(); i != e; ++i)
+      N->addOperand(I->getOperand(i));
+  }
+}
 
-  Builder.populateFunctionPassManager(FPM);
-  Builder.populateModulePassManager(MPM);
+// Reduces the lazily loaded module Src to the definitions that are needed to
+// resolve the declarations in Dst.  Only the bodies of those functions are
+// materialized; everything unreferenced is deleted without being read.
+// Collects into Live the symbols of Src needed to resolve Dst's declarations.
+static std::error_code CollectReferenced(Module *Src, Module *Dst,
+                                         SmallPtrSetImpl<GlobalValue *> &Live) {
+  SmallVector<GlobalValue *, 64> Worklist;
+
+  // Seed with the symbols Dst uses but does not define.
+  std::vector<GlobalValue *> Undefined;
+  for (Module::iterator I = Dst->begin(), E = Dst->end(); I != E; ++I)
+    if (I->isDeclaration())
+      Undefined.push_back(I);
+  for (Module::global_iterator I = Dst->global_begin(), E = Dst->global_end();
+       I != E; ++I)
+    if (I->isDeclaration())
+      Undefined.push_back(I);
+  for (GlobalValue *GV : Undefined)
+    if (GV->hasName())
+      if (GlobalValue *SGV = Src->getNamedValue(GV->getName()))
+        if (Live.insert(SGV).second)
+          Worklist.push_back(SGV);
+
+  // Walk everything reachable from the seeds.
+  return CollectReachable(Live, Worklist);
 }
 
+static std::error_code PruneToReferenced(Module *Src, Module *Dst) {
+  SmallPtrSet<GlobalValue *, 64> Live;
+  if (std::error_code EC = CollectReferenced(Src, Dst, Live))
+    return EC;
+
+  // Delete the rest.  Intrinsic declarations stay since the bitcode reader may
+  // still refer to them when it upgrades intrinsic calls.
+  std::vector<GlobalValue *> Dead;
+  for (Module::iterator I = Src->begin(), E = Src->end(); I != E; ++I)
+    if (!Live.count(I) && !I->isIntrinsic())
+      Dead.push_back(I);
+  for (Module::global_iterator I = Src->global_begin(), E = Src->global_end();
+       I != E; ++I)
+    if (!Live.count(I))
+      Dead.push_back(I);
+  for (Module::alias_iterator I = Src->alias_begin(), E = Src->alias_end();
+       I != E; ++I)
+    if (!Live.count(I))
+      Dead.push_back(I);
+  EraseGlobalValues(Dead);
+
+  // Everything left has been materialized; let the reader finish the module.
+  return Src->materializeAll();
+}
 
-// Returns the TargetMachine instance or zero if no triple is provided.
-static TargetMachine* GetTargetMachine(Triple TheTriple, int OptLevel) {
-  std::string Error;
-  const Target *TheTarget = TargetRegistry::lookupTarget(MArch, TheTriple,
-                                                         Error);
-  // Some modules don't specify a triple, and this is okay.
-  if (!TheTarget) {
-    return nullptr;
+// Copies the symbols of Src in Live into a new module, as CloneModule does
+// but leaving out everything else, so Live has to hold whatever the copied
+// bodies and initializers refer to.  Named metadata is not copied.  VMap
+// maps Src's symbols to their copies.
+static Module *CloneLiveSet(Module *Src,
+                            const SmallPtrSetImpl<GlobalValue *> &Live,
+                            ValueToValueMapTy &VMap) {
+  Module *Copy = new Module(Src->getModuleIdentifier(), Src->getContext());
+  if (const DataLayout *DL = Src->getDataLayout())
+    Copy->setDataLayout(DL);
+  Copy->setTargetTriple(Src->getTargetTriple());
+  Copy->setModuleInlineAsm(Src->getModuleInlineAsm());
+
+  // Create all the symbols first so bodies and initializers can refer to
+  // any of them.
+  for (Module::global_iterator I = Src->global_begin(), E = Src->global_end();
+       I != E; ++I) {
+    if (!Live.count(I))
+      continue;
+    GlobalVariable *GV = new GlobalVariable(
+        *Copy, I->getType()->getElementType(), I->isConstant(),
+        I->getLinkage(), nullptr, I->getName(), nullptr,
+        I->getThreadLocalMode(), I->getType()->getAddressSpace());
+    GV->copyAttributesFrom(I);
+    VMap[I] = GV;
+  }
+  for (Module::iterator I = Src->begin(), E = Src->end(); I != E; ++I) {
+    if (!Live.count(I))
+      continue;
+    Function *F = Function::Create(
+        cast<FunctionType>(I->getType()->getElementType()), I->getLinkage(),
+        I->getName(), Copy);
+    F->copyAttributesFrom(I);
+    VMap[I] = F;
   }
 
-  // Package up features to be passed to target/subtarget
-  std::string FeaturesStr;
-  if (MAttrs.size()) {
-    SubtargetFeatures Features;
-    for (unsigned i = 0; i != MAttrs.size(); ++i)
-      Features.AddFeature(MAttrs[i]);
-    FeaturesStr = Features.getString();
+  for (Module::global_iterator I = Src->global_begin(), E = Src->global_end();
+       I != E; ++I)
+    if (Live.count(I) && I->hasInitializer())
+      cast<GlobalVariable>(VMap[I])->setInitializer(
+          MapValue(I->getInitializer(), VMap));
+  for (Module::iterator I = Src->begin(), E = Src->end(); I != E; ++I) {
+    if (!Live.count(I) || I->isDeclaration())
+      continue;
+    Function *F = cast<Function>(VMap[I]);
+    Function::arg_iterator DestI = F->arg_begin();
+    for (Function::const_arg_iterator J = I->arg_begin(); J != I->arg_end();
+         ++J) {
+      DestI->setName(J->getName());
+      VMap[J] = DestI++;
+    }
+    SmallVector<ReturnInst *, 8> Returns;
+    CloneFunctionInto(F, I, VMap, /*ModuleLevelChanges=*/true, Returns);
   }
+  return Copy;
+}
 
-  return TheTarget->createTargetMachine(TheTriple.getTriple(),
-                                        MCPU, FeaturesStr,
-                                        InitTargetOptionsFromCodeGenFlags(),
-                                        RelocModel, CMModel,
-                                        GetCodeGenOptLevel(OptLevel));
+// Copies the definitions of Src needed by Dst into a new module in Copy,
+// leaving Src intact so it can serve later links; the bodies read from a lazy
+// Src stay loaded.  Leaves Copy empty if Src has aliases or named metadata,
+// which it doesn't handle.
+static std::error_code CloneReferenced(Module *Src, Module *Dst,
+                                       std::unique_ptr<Module> &Copy) {
+  if (Src->alias_begin() != Src->alias_end() ||
+      Src->named_metadata_begin() != Src->named_metadata_end())
+    return std::error_code();
+
+  SmallPtrSet<GlobalValue *, 64> Live;
+  if (std::error_code EC = CollectReferenced(Src, Dst, Live))
+    return EC;
+
+  ValueToValueMapTy VMap;
+  Copy.reset(CloneLiveSet(Src, Live, VMap));
+  return std::error_code();
 }
 
+// Every option passed to HLC_SetCommandLineOption so far, in order.  Part of
+// the compile cache key since the options change codegen.
+static std::mutex CommandLineLock;
+static std::string CommandLineState;
+
+// Bumped by HLC_SetCommandLineOption.  State derived from the command-line
+// flags records the generation it was built for, so flag changes are noticed.
+static std::atomic<unsigned> CommandLineGeneration(0);
+
+/// C layout of the per-session tuning set by HLC_SessionSetCompileOptions.
+/// Null strings mean the target's defaults.
+struct CompileOptions {
+  int DisableInline;
+  int UnitAtATime;
+  int DisableLoopVectorization;
+  int DisableSLPVectorization;
+  int DisableSimplifyLibCalls;
+  const char *CPU;      // like -mcpu
+  const char *Features; // like -mattr, e.g. "+feature1,-feature2"
+};
 
-void Initialize() {
-  using namespace llvm;
+/// The optimizer and codegen settings a compile runs with.  Sessions without
+/// options of their own take them from the globals above and the -mcpu and
+/// -mattr command-line flags.
+struct SessionOptions {
+  bool DisableInline;
+  bool UnitAtATime;
+  bool DisableLoopVectorization;
+  bool DisableSLPVectorization;
+  bool DisableSimplifyLibCalls;
+  bool DisableLoopUnrolling; // only set for the over-budget fallback
+  std::string CPU;
+  std::string Features; // subtarget features, for optimizer and codegen
+
+  static SessionOptions fromGlobals() {
+    SessionOptions O;
+    O.DisableInline = libHLC::DisableInline;
+    O.UnitAtATime = libHLC::UnitAtATime;
+    O.DisableLoopVectorization = libHLC::DisableLoopVectorization;
+    O.DisableSLPVectorization = libHLC::DisableSLPVectorization;
+    O.DisableSimplifyLibCalls = libHLC::DisableSimplifyLibCalls;
+    O.DisableLoopUnrolling = false;
+
+    // HLC_SetCommandLineOption writes the flags under the same lock.
+    std::lock_guard<std::mutex> Guard(CommandLineLock);
+    O.CPU = MCPU;
+    if (MAttrs.size()) {
+      SubtargetFeatures Features;
+      for (unsigned i = 0; i != MAttrs.size(); ++i)
+        Features.AddFeature(MAttrs[i]);
+      O.Features = Features.getString();
+    }
+    return O;
+  }
 
-  if ( TheContext != nullptr ) {
-    // Already initialized
-    return;
+  static SessionOptions fromC(const CompileOptions &C) {
+    SessionOptions O;
+    O.DisableInline = C.DisableInline;
+    O.UnitAtATime = C.UnitAtATime;
+    O.DisableLoopVectorization = C.DisableLoopVectorization;
+    O.DisableSLPVectorization = C.DisableSLPVectorization;
+    O.DisableSimplifyLibCalls = C.DisableSimplifyLibCalls;
+    O.DisableLoopUnrolling = false;
+    O.CPU = C.CPU ? C.CPU : "";
+    O.Features = C.Features ? C.Features : "";
+    return O;
   }
 
-  sys::PrintStackTraceOnErrorSignal();
-  EnablePrettyStackTrace();
+  // Appends a description of every setting to os, for cache keys.
+  void print(raw_ostream &os) const {
+    os << DisableInline << UnitAtATime << DisableLoopVectorization
+       << DisableSLPVectorization << DisableSimplifyLibCalls
+       << DisableLoopUnrolling << " cpu=" << CPU << " features=" << Features;
+  }
+};
 
-  // Enable debug stream buffering.
-  EnableDebugBuffering = true;
+/// Everything that goes into the creation of a TargetMachine.
+struct TargetMachineKey {
+  std::string Arch;
+  std::string Triple;
+  std::string CPU;
+  std::string Features;
+  Reloc::Model RM;
+  CodeModel::Model CM;
+  CodeGenOpt::Level OptLevel;
+  // Take the TargetOptions from the codegen flags instead of the defaults.
+  bool FlagOptions;
+  unsigned Generation;
+
+  bool operator<(const TargetMachineKey &RHS) const {
+    return std::tie(Arch, Triple, CPU, Features, RM, CM, OptLevel,
+                    FlagOptions, Generation) <
+           std::tie(RHS.Arch, RHS.Triple, RHS.CPU, RHS.Features, RHS.RM,
+                    RHS.CM, RHS.OptLevel, RHS.FlagOptions, RHS.Generation);
+  }
+};
 
-  LLVMContext &Context = getGlobalContext();
-  TheContext = &Context;
+/// Keeps TargetMachine instances alive so that compiles with the same target
+/// configuration don't pay for target lookup and creation every time.
+class TargetMachineCache {
+public:
+  TargetMachineCache() : Generation(0), Hits(0), Misses(0) { }
+
+  // Returns the TargetMachine for Key, creating it on a miss.  The cache keeps
+  // ownership.  Returns nullptr and sets Error if the target is unavailable.
+  TargetMachine *get(const TargetMachineKey &Key, std::string &Error) {
+    // Machines built for an older set of command-line flags are stale.
+    if (Key.Generation != Generation) {
+      Machines.clear();
+      Generation = Key.Generation;
+    }
 
-  // Initialize targets
-  InitializeAllTargets();
-  InitializeAllTargetMCs();
-  InitializeAllAsmPrinters();
-  InitializeAllAsmParsers();
+    auto It = Machines.find(Key);
+    if (It != Machines.end()) {
+      ++Hits;
+      return It->second.get();
+    }
+    ++Misses;
+
+    Triple TheTriple(Key.Triple);
+    const Target *TheTarget = TargetRegistry::lookupTarget(Key.Arch, TheTriple,
+                                                           Error);
+    if (!TheTarget)
+      return nullptr;
+
+    TargetOptions Options;
+    if (Key.FlagOptions)
+      Options = InitTargetOptionsFromCodeGenFlags();
+
+    TargetMachine *TM = TheTarget->createTargetMachine(Key.Triple, Key.CPU,
+                                                       Key.Features, Options,
+                                                       Key.RM, Key.CM,
+                                                       Key.OptLevel);
+    if (!TM) {
+      Error = "could not allocate target machine";
+      return nullptr;
+    }
+    Machines[Key].reset(TM);
+    return TM;
+  }
 
-  // Initialize passes
-  PassRegistry &Registry = *PassRegistry::getPassRegistry();
-  initializeCore(Registry);
-  initializeScalarOpts(Registry);
-  initializeObjCARCOpts(Registry);
-  initializeVectorization(Registry);
-  initializeIPO(Registry);
-  initializeAnalysis(Registry);
-  initializeIPA(Registry);
-  initializeTransformUtils(Registry);
-  initializeInstCombine(Registry);
-  initializeInstrumentation(Registry);
-  initializeTarget(Registry);
-  // For codegen passes, only passes that do IR to IR transformation are
-  // supported.
-  initializeCodeGenPreparePass(Registry);
-  initializeAtomicExpandPass(Registry);
-  initializeRewriteSymbolsPass(Registry);
+  size_t hits() const { return Hits; }
+  size_t misses() const { return Misses; }
 
-  initializeCodeGen(Registry);
-  initializeLoopStrengthReducePass(Registry);
-  initializeLowerIntrinsicsPass(Registry);
-  initializeUnreachableBlockElimPass(Registry);
-}
+private:
+  std::map<TargetMachineKey, std::unique_ptr<TargetMachine>> Machines;
+  unsigned Generation;
+  size_t Hits;
+  size_t Misses;
+};
 
-void Finalize() {
-  using namespace llvm;
+/// Outputs of CompilePipeline.  The buffers are malloc'd; anything still
+/// held when the object goes away is freed.
+struct CompileOutput {
+  char *HSAIL = nullptr;
+  size_t HSAILSize = 0;
+  char *BRIG = nullptr;
+  size_t BRIGSize = 0;
+
+  ~CompileOutput() {
+    free(HSAIL);
+    free(BRIG);
+  }
+};
 
-  llvm_shutdown();
+// Returns the MD5 of Data as a hex string.
+static std::string HashString(StringRef Data) {
+  MD5 Hash;
+  Hash.update(Data);
+  MD5::MD5Result Result;
+  Hash.final(Result);
+  SmallString<32> Hex;
+  MD5::stringifyResult(Result, Hex);
+  return Hex.str();
 }
 
-void Optimize(llvm::Module *M, int OptLevel, int SizeLevel, int Verify) {
+// Linked in by the Makefile from builtins-hsail.opt.bc.
+extern "C" const char _binary_builtins_hsail_opt_bc_start[];
+extern "C" const char _binary_builtins_hsail_opt_bc_end[];
 
-    // Create a PassManager to hold and optimize the collection of passes we are
-    // about to build.
-    //
-    PassManager Passes;
+static StringRef GetEmbeddedBuiltins() {
+  return StringRef(_binary_builtins_hsail_opt_bc_start,
+                   _binary_builtins_hsail_opt_bc_end -
+                   _binary_builtins_hsail_opt_bc_start);
+}
 
-    // Add an appropriate TargetLibraryInfo pass for the module's triple.
-    TargetLibraryInfo *TLI = new TargetLibraryInfo(Triple(M->getTargetTriple()));
+static const std::string &GetEmbeddedBuiltinsHash() {
+  static const std::string Hash = HashString(GetEmbeddedBuiltins());
+  return Hash;
+}
 
-    // The -disable-simplify-libcalls flag actually disables all builtin optzns.
-    if (DisableSimplifyLibCalls)
-      TLI->disableAllFunctions();
-    Passes.add(TLI);
+// Identifies the format of a DiskCache entry.
+static const char CacheEntryMagic[] = "HLCC0001";
 
-    // Add an appropriate DataLayout instance for this module.
-    const DataLayout *DL = M->getDataLayout();
-    if (DL)
-      Passes.add(new DataLayoutPass());
+/// Content-addressed store for compile outputs in a directory that several
+/// processes may share.  Entries are written to a unique temporary file and
+/// renamed into place, so a reader never sees a partial entry.  Entries are
+/// read through MemoryBuffer::getFile, which memory-maps all but small files.
+/// The directory is kept under MaxBytes by evicting the least recently used
+/// entries.
+class DiskCache {
+public:
+  DiskCache(StringRef Dir, uint64_t MaxBytes) : Dir(Dir), MaxBytes(MaxBytes) { }
+
+  // Fills Out from the entry for Key.  Returns false on a miss.
+  bool lookup(StringRef Key, CompileOutput &Out) {
+    std::string Path = entryPath(Key);
+    ErrorOr<std::unique_ptr<MemoryBuffer>> BufOrErr =
+        MemoryBuffer::getFile(Path, -1, /*RequiresNullTerminator=*/false);
+    if (!BufOrErr)
+      return false;
+    StringRef Data = BufOrErr.get()->getBuffer();
+
+    EntryHeader Header;
+    if (Data.size() < sizeof(Header))
+      return false;
+    memcpy(&Header, Data.data(), sizeof(Header));
+    if (memcmp(Header.Magic, CacheEntryMagic, sizeof(Header.Magic)) != 0 ||
+        Data.size() != sizeof(Header) + Header.HSAILSize + Header.BRIGSize)
+      return false;
+
+    const char *Payload = Data.data() + sizeof(Header);
+    if (Header.HSAILSize)
+      Out.HSAIL = copyOut(Payload, Header.HSAILSize, Out.HSAILSize);
+    if (Header.BRIGSize)
+      Out.BRIG = copyOut(Payload + Header.HSAILSize, Header.BRIGSize,
+                         Out.BRIGSize);
+
+    // Record the use for eviction.
+    int FD;
+    if (!sys::fs::openFileForRead(Path, FD)) {
+      sys::fs::setLastModificationAndAccessTime(FD, sys::TimeValue::now());
+      ::close(FD);
+    }
+    return true;
+  }
 
-    Triple ModuleTriple(M->getTargetTriple());
-    TargetMachine *Machine = nullptr;
-    if (ModuleTriple.getArch())
-      Machine = GetTargetMachine(Triple(ModuleTriple), OptLevel);
-    std::unique_ptr<TargetMachine> TM(Machine);
+  // Stores Out under Key.  Failures only cost a later cache miss.
+  void store(StringRef Key, const CompileOutput &Out) {
+    if (sys::fs::create_directories(Dir))
+      return;
+
+    int FD;
+    SmallString<128> TmpPath;
+    if (sys::fs::createUniqueFile(Dir + "/tmp-%%%%%%%%%%%%", FD, TmpPath))
+      return;
+
+    EntryHeader Header;
+    memcpy(Header.Magic, CacheEntryMagic, sizeof(Header.Magic));
+    Header.HSAILSize = Out.HSAIL ? Out.HSAILSize : 0;
+    Header.BRIGSize = Out.BRIG ? Out.BRIGSize : 0;
+    {
+      raw_fd_ostream os(FD, /*shouldClose=*/true);
+      os.write(reinterpret_cast<const char *>(&Header), sizeof(Header));
+      os.write(Out.HSAIL, Header.HSAILSize);
+      os.write(Out.BRIG, Header.BRIGSize);
+      os.close();
+      if (os.has_error()) {
+        os.clear_error();
+        sys::fs::remove(TmpPath);
+        return;
+      }
+    }
+    if (sys::fs::rename(TmpPath, entryPath(Key))) {
+      sys::fs::remove(TmpPath);
+      return;
+    }
+    prune();
+  }
 
-    // Add internal analysis passes from the target machine.
-    if (TM.get())
-      TM->addAnalysisPasses(Passes);
+private:
+  struct EntryHeader {
+    char Magic[8];
+    uint64_t HSAILSize;
+    uint64_t BRIGSize;
+  };
+  std::string entryPath(StringRef Key) const {
+    return (Twine(Dir) + "/" + Key + ".hlcc").str();
+  }
 
-    std::unique_ptr<FunctionPassManager> FPasses;
-    if (OptLevel > 0 || SizeLevel > 0) {
-      FPasses.reset(new FunctionPassManager(M));
-      if (DL)
-        FPasses->add(new DataLayoutPass());
-      if (TM.get())
-        TM->addAnalysisPasses(*FPasses);
+  // Copies a payload into a NUL-terminated malloc'd buffer.
+  static char *copyOut(const char *Data, size_t Len, size_t &OutLen) {
+    char *Buf = (char *)malloc(Len + 1);
+    if (!Buf)
+      report_fatal_error("out of memory while reading the compile cache");
+    memcpy(Buf, Data, Len);
+    Buf[Len] = '\0';
+    OutLen = Len;
+    return Buf;
+  }
 
+  // Evicts the least recently used entries until the directory is within
+  // MaxBytes.  Other processes may be pruning at the same time, so failures
+  // to remove an entry are ignored.
+  void prune() {
+    if (!MaxBytes)
+      return;
+
+    struct Entry {
+      sys::TimeValue Time;
+      uint64_t Size;
+      std::string Path;
+    };
+    std::vector<Entry> Entries;
+    uint64_t Total = 0;
+    std::error_code EC;
+    for (sys::fs::directory_iterator I(Dir, EC), E; I != E && !EC;
+         I.increment(EC)) {
+      if (sys::path::extension(I->path()) != ".hlcc")
+        continue;
+      sys::fs::file_status Status;
+      if (I->status(Status))
+        continue;
+      Entries.push_back({Status.getLastModificationTime(), Status.getSize(),
+                         I->path()});
+      Total += Status.getSize();
     }
-
-    AddOptimizationPasses(Passes, *FPasses, OptLevel, SizeLevel);
-
-    if (OptLevel > 0 || SizeLevel > 0) {
-      FPasses->doInitialization();
-      for (Module::iterator F = M->begin(), E = M->end(); F != E; ++F)
-        FPasses->run(*F);
-      FPasses->doFinalization();
+    if (Total <= MaxBytes)
+      return;
+
+    std::sort(Entries.begin(), Entries.end(),
+              [](const Entry &A, const Entry &B) { return A.Time < B.Time; });
+    for (const Entry &Ent : Entries) {
+      if (Total <= MaxBytes)
+        break;
+      sys::fs::remove(Ent.Path);
+      Total -= Ent.Size;
     }
+  }
 
-    // Check that the module is well formed on completion of optimization
-    if (Verify) {
-      Passes.add(createVerifierPass());
-      Passes.add(createDebugInfoVerifierPass());
-    }
+  std::string Dir;
+  uint64_t MaxBytes;
+};
 
-    // Now that we have all of the passes ready, run them.
-    Passes.run(*M);
-}
+/// How ParseInSession reads its input.
+enum ParseMode {
+  ParseAssembly,         // NUL-terminated textual IR
+  ParseBitcode,          // bitcode, fully materialized
+  ParseBitcodeLazy,      // bitcode, bodies read on demand from a copy
+  ParseBitcodeBorrowed,  // bitcode, bodies read on demand from the caller's
+                         // buffer
+  NumParseModes
+};
 
-static const std::string MArch = "hsail64";
+/// Measurements of the latest compile in a session, as returned by
+/// HLC_GetLastCompileStats.  Each phase overwrites its own fields when it
+/// runs; HLC_SessionCompile clears them all first.  Times are wall-clock
+/// seconds.  Laid out for C callers: doubles first, then size_t fields.
+struct CompileStats {
+  double ParseSeconds;
+  double LinkSeconds;
+  double OptimizeSeconds;
+  double HSAILSeconds;       // codegen of HSAIL text
+  double BRIGSeconds;        // codegen of BRIG
+  size_t InputBytes;         // size of the parsed IR or bitcode
+  size_t InstructionsBefore; // instructions when Optimize() started
+  size_t InstructionsAfter;  // instructions when Optimize() finished
+  size_t HSAILBytes;
+  size_t BRIGBytes;
+  size_t InputFormat;        // ParseMode of the last parse
+  size_t OptimizePeakBytes;  // process RSS growth seen during Optimize()
+  size_t OptimizeFallback;   // 1 if Optimize() went over budget
+};
 
-// The following function is adapted from llc.cpp
-int CompileModule(Module *mod, raw_string_ostream &os, bool emitBRIG,
-                  int OptLevel) {
-  // Load the module to be compiled...
-  SMDiagnostic Err;
+/// Running totals of the parses in a session for one ParseMode.
+struct ParseTotals {
+  double Seconds;
+  size_t Count;
+  size_t Bytes;
+};
 
-  Triple TheTriple;
+/// Stores the wall time from construction to destruction in Seconds.
+class PhaseTimer {
+public:
+  explicit PhaseTimer(double &Seconds)
+    : Seconds(Seconds), Start(TimeRecord::getCurrentTime(true)) { }
 
-  TheTriple = Triple(mod->getTargetTriple());
+  ~PhaseTimer() {
+    Seconds = TimeRecord::getCurrentTime(false).getWallTime() -
+              Start.getWallTime();
+  }
 
-  if (TheTriple.getTriple().empty())
-    TheTriple.setTriple(sys::getDefaultTargetTriple());
+private:
+  double &Seconds;
+  TimeRecord Start;
+};
 
-  // Get the target specific parser.
-  std::string Error;
-  const Target *TheTarget = TargetRegistry::lookupTarget(MArch, TheTriple,
-                                                         Error);
-  if (!TheTarget) {
-    errs() << Error;
+// Resident set size of the process, from /proc/self/statm.  Unlike the heap
+// counters of mallinfo, it doesn't wrap past 2 GiB and includes allocations
+// malloc serves with mmap.  Zero if it can't be read.
+static size_t GetResidentBytes() {
+  FILE *F = fopen("/proc/self/statm", "r");
+  if (!F)
     return 0;
-  }
+  unsigned long Pages, Resident;
+  int Read = fscanf(F, "%lu %lu", &Pages, &Resident);
+  fclose(F);
+  return Read == 2 ? Resident * sysconf(_SC_PAGESIZE) : 0;
+}
 
-  // Package up features to be passed to target/subtarget
-  std::string FeaturesStr;
+// Optimizer and codegen runs in progress in the process.  The memory a
+// budget sees is process-wide, so it is only enforced while its compile is
+// the only one running.
+static std::atomic<unsigned> RunningCompiles(0);
 
-  CodeGenOpt::Level OLvl = CodeGenOpt::Default;
+/// Counts itself in RunningCompiles while alive.
+class CompileActivity {
+public:
+  CompileActivity() { ++RunningCompiles; }
+  ~CompileActivity() { --RunningCompiles; }
+};
 
-  switch (OptLevel) {
-  case 0: OLvl = CodeGenOpt::None; break;
-  case 1: OLvl = CodeGenOpt::Less; break;
-  case 2: OLvl = CodeGenOpt::Default; break;
-  case 3: OLvl = CodeGenOpt::Aggressive; break;
+/// Watches the resident memory growth and wall time of one optimizer run.
+/// Probe passes call check(), which reports once a limit has been passed;
+/// the budget then stays stopped and the pipeline winds down as described at
+/// BudgetProbe.  The memory figure is process-wide: it includes whatever
+/// other threads allocate meanwhile, which is why the memory limit is only
+/// enforced while no other compile runs.  Zero limits only record the peak.
+/// check() may be called from several threads.
+class CompileBudget {
+public:
+  CompileBudget(size_t MaxBytes, double MaxSeconds)
+    : MaxBytes(MaxBytes), MaxSeconds(MaxSeconds),
+      StartBytes(GetResidentBytes()), Start(std::chrono::steady_clock::now()),
+      Peak(0), NextSample(0), Stopped(false) { }
+
+  // Takes a memory sample at most once a millisecond.  Returns whether the
+  // budget is used up.
+  bool check() {
+    if (Stopped)
+      return true;
+    int64_t Elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - Start).count();
+    if (MaxSeconds > 0 && Elapsed > MaxSeconds * 1e6)
+      Stopped = true;
+    int64_t Next = NextSample;
+    if (Elapsed >= Next &&
+        NextSample.compare_exchange_strong(Next, Elapsed + 1000)) {
+      record();
+      if (MaxBytes && Peak > MaxBytes && RunningCompiles == 1)
+        Stopped = true;
+    }
+    return Stopped;
   }
 
-  TargetOptions Options;
-
-  std::unique_ptr<TargetMachine> target(
-      TheTarget->createTargetMachine(TheTriple.getTriple(), MCPU, FeaturesStr,
-                                     Options, RelocModel, CMModel, OLvl));
-  assert(target.get() && "Could not allocate target machine!");
-  assert(mod && "Should have exited if we didn't have a module!");
-  TargetMachine &Target = *target.get();
-
-  if (GenerateSoftFloatCalls)
-    FloatABIForCalls = FloatABI::Soft;
+  // Updates the peak from a fresh sample without checking the limits.
+  void record() {
+    size_t Bytes = GetResidentBytes();
+    size_t Growth = Bytes > StartBytes ? Bytes - StartBytes : 0;
+    size_t Old = Peak;
+    while (Growth > Old && !Peak.compare_exchange_weak(Old, Growth)) { }
+  }
 
-  // Build up all of the passes that we want to do to the module.
-  PassManager PM;
+  bool stopped() const { return Stopped; }
+  size_t peak() const { return Peak; }
 
-  // Add an appropriate TargetLibraryInfo pass for the module's triple.
-  TargetLibraryInfo *TLI = new TargetLibraryInfo(TheTriple);
-  if (DisableSimplifyLibCalls)
-    TLI->disableAllFunctions();
-  PM.add(TLI);
+private:
+  size_t MaxBytes;
+  double MaxSeconds;
+  size_t StartBytes;
+  std::chrono::steady_clock::time_point Start;
+  std::atomic<size_t> Peak;
+  std::atomic<int64_t> NextSample; // microseconds after Start
+  std::atomic<bool> Stopped;
+};
 
-  // Add the target data from the target machine, if it exists, or the module.
-  if (const DataLayout *DL = Target.getSubtargetImpl()->getDataLayout())
-    mod->setDataLayout(DL);
-  PM.add(new DataLayoutPass());
+/// Checks the budget its pipeline runs under, if any.  Added at several
+/// extension points of the optimizer pipeline, e.g. after each round of
+/// inlining and after the loop passes.  Nothing is thrown through the pass
+/// managers: once the budget is used up the probe marks every function of
+/// the module optnone and noinline, so the passes left in the current pass
+/// manager skip them and the inliner stops growing the code.  The pipeline
+/// owner checks the budget between pass managers and throws the result away.
+class BudgetProbe : public FunctionPass {
+public:
+  static char ID;
+  explicit BudgetProbe(CompileBudget *const *Budget)
+    : FunctionPass(ID), Budget(Budget) { }
 
-  auto FileType = (emitBRIG
-                   ? TargetMachine::CGFT_ObjectFile
-                   : TargetMachine::CGFT_AssemblyFile);
+  const char *getPassName() const override { return "HLC budget probe"; }
 
-  formatted_raw_ostream FOS(os);
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.setPreservesAll();
+  }
 
-  // Ask the target to add backend passes as necessary.
-  bool Verify = false;
-  if (Target.addPassesToEmitFile(PM, FOS, FileType, Verify)) {
-    errs() << "target does not support generation of this"
-           << " file type!\n";
-    return 0;
+  bool runOnFunction(Function &F) override {
+    if (!*Budget || F.hasFnAttribute(Attribute::OptimizeNone) ||
+        !(*Budget)->check())
+      return false;
+    // The whole module is marked at once, so a marked F means done.
+    for (Function &G : *F.getParent()) {
+      if (G.isDeclaration() || G.hasFnAttribute(Attribute::AlwaysInline))
+        continue;
+      // The verifier rejects optnone next to optsize or minsize, which cold
+      // functions from SetFunctionHotness and -Os/-Oz builds carry.
+      G.removeFnAttr(Attribute::OptimizeForSize);
+      G.removeFnAttr(Attribute::MinSize);
+      G.addFnAttr(Attribute::OptimizeNone);
+      G.addFnAttr(Attribute::NoInline);
+    }
+    return true;
   }
 
-  PM.run(*mod);
+private:
+  // Where the owner of the pipeline puts the budget of the current run.
+  CompileBudget *const *Budget;
+};
 
-  return 1;
-}
+char BudgetProbe::ID = 0;
 
-} // end libHLC namespace
+/// PassManagerBuilder extensions are plain functions; this carries the budget
+/// slot to AddBudgetProbe.
+class BudgetedBuilder : public PassManagerBuilder {
+public:
+  explicit BudgetedBuilder(CompileBudget *const *Budget) : Budget(Budget) { }
 
-extern "C" {
+  CompileBudget *const *Budget;
+};
 
-using namespace libHLC;
+static void AddBudgetProbe(const PassManagerBuilder &Builder,
+                           PassManagerBase &PM) {
+  const BudgetedBuilder &Budgeted =
+      static_cast<const BudgetedBuilder &>(Builder);
+  PM.add(new BudgetProbe(Budgeted.Budget));
+}
 
-typedef struct OpaqueModule* llvm_module_ptr;
+// Probes the budget where code tends to grow, if the pipeline has one.
+static void AddBudgetProbes(BudgetedBuilder &Builder) {
+  if (!Builder.Budget)
+    return;
+  Builder.addExtension(PassManagerBuilder::EP_EarlyAsPossible,
+                       AddBudgetProbe);
+  Builder.addExtension(PassManagerBuilder::EP_Peephole, AddBudgetProbe);
+  Builder.addExtension(PassManagerBuilder::EP_LoopOptimizerEnd,
+                       AddBudgetProbe);
+  Builder.addExtension(PassManagerBuilder::EP_ScalarOptimizerLate,
+                       AddBudgetProbe);
+  Builder.addExtension(PassManagerBuilder::EP_OptimizerLast, AddBudgetProbe);
+}
 
-void HLC_Initialize() {
-  Initialize();
+static size_t CountInstructions(const Function &F) {
+  size_t Count = 0;
+  for (Function::const_iterator BB = F.begin(), E = F.end(); BB != E; ++BB)
+    Count += BB->size();
+  return Count;
 }
 
-void HLC_Finalize() {
-  Finalize();
+static size_t CountInstructions(const Module &M) {
+  size_t Count = 0;
+  for (Module::const_iterator F = M.begin(), E = M.end(); F != E; ++F)
+    Count += CountInstructions(*F);
+  return Count;
 }
 
+/// One function of a ModuleInfo snapshot.  C layout; the strings and the
+/// argument array belong to the snapshot.
+struct FunctionInfo {
+  const char *Name;
+  const char *Type;            // printed function type, e.g. "void (i32)"
+  int Linkage;                 // a GlobalValue::LinkageTypes value
+  int CallingConv;             // a CallingConv::ID value
+  int IsDeclaration;
+  int IsKernel;                // spir_kernel calling convention
+  size_t NumArgs;
+  const int *ArgAddressSpaces; // per argument, -1 if it is not a pointer
+  long NumBlocks;               // -1 if the body hasn't been read yet
+  long NumInstructions;         // -1 if the body hasn't been read yet
+};
 
-char* HLC_CreateString(const char *str) {
-    return strdup(str);
-}
+/// One global variable of a ModuleInfo snapshot.  C layout.
+struct GlobalInfo {
+  const char *Name;
+  const char *Type;            // printed value type
+  int Linkage;                 // a GlobalValue::LinkageTypes value
+  int AddressSpace;
+  int IsDeclaration;
+  int IsConstant;
+};
 
-void HLC_DisposeString(char *str) {
-  free(str);
-}
+/// Summary of the functions and globals of a module, read straight from the
+/// IR so callers need not print the module and parse the text.  It copies
+/// everything it reports and stays valid after the module changes or dies.
+class ModuleInfo {
+public:
+  explicit ModuleInfo(const Module &M) {
+    // Fill the argument array first: FunctionInfo points into it.
+    for (const Function &F : M)
+      for (const Argument &A : F.args()) {
+        PointerType *PT = dyn_cast<PointerType>(A.getType());
+        ArgSpaces.push_back(PT ? PT->getAddressSpace() : -1);
+      }
 
-ModuleRef* HLC_ParseModule(const char *Asm) {
-  return ModuleRef::parseAssembly(Asm);
-}
+    size_t NextArg = 0;
+    for (const Function &F : M) {
+      FunctionInfo Info;
+      Info.Name = save(F.getName());
+      Info.Type = save(print(F.getFunctionType()));
+      Info.Linkage = F.getLinkage();
+      Info.CallingConv = F.getCallingConv();
+      Info.IsDeclaration = F.isDeclaration();
+      Info.IsKernel = F.getCallingConv() == CallingConv::SPIR_KERNEL;
+      Info.NumArgs = F.arg_size();
+      Info.ArgAddressSpaces = ArgSpaces.data() + NextArg;
+      if (F.isMaterializable()) {
+        Info.NumBlocks = -1;
+        Info.NumInstructions = -1;
+      } else {
+        Info.NumBlocks = F.size();
+        Info.NumInstructions = CountInstructions(F);
+      }
+      NextArg += Info.NumArgs;
+      Functions.push_back(Info);
+    }
 
-ModuleRef* HLC_ParseBitcode(const char *Asm, size_t Len) {
-  return ModuleRef::parseBitcode(Asm, Len);
-}
+    for (const GlobalVariable &GV : M.globals()) {
+      GlobalInfo Info;
+      Info.Name = save(GV.getName());
+      Info.Type = save(print(GV.getType()->getElementType()));
+      Info.Linkage = GV.getLinkage();
+      Info.AddressSpace = GV.getType()->getAddressSpace();
+      Info.IsDeclaration = GV.isDeclaration();
+      Info.IsConstant = GV.isConstant();
+      Globals.push_back(Info);
+    }
+  }
 
-// ModuleRef* HLC_ParseBitcodeFile(const char *Asm, size_t Len) {
-  // return ModuleRef::parseBitcode(Asm, Len);
-// }
+  ArrayRef<FunctionInfo> functions() const { return Functions; }
+  ArrayRef<GlobalInfo> globals() const { return Globals; }
 
-void HLC_ModulePrint(ModuleRef *M, char **output) {
-  *output = HLC_CreateString(M->to_string().c_str());
-}
+private:
+  const char *save(StringRef Str) {
+    char *Copy = Strings.Allocate<char>(Str.size() + 1);
+    memcpy(Copy, Str.data(), Str.size());
+    Copy[Str.size()] = '\0';
+    return Copy;
+  }
 
-void HLC_ModuleDestroy(ModuleRef *M) {
-  M->destroy();
-  delete M;
-}
+  static std::string print(Type *T) {
+    std::string Buf;
+    raw_string_ostream OS(Buf);
+    T->print(OS);
+    return OS.str();
+  }
 
-int HLC_ModuleOptimize(ModuleRef *M, int OptLevel, int SizeLevel, int Verify) {
-  if (OptLevel < 0 && OptLevel > 3) return 0;
-  if (SizeLevel < 0 && SizeLevel > 2) return 0;
-  Optimize(M->get(), OptLevel, SizeLevel, Verify);
-  return 1;
-}
+  std::vector<FunctionInfo> Functions;
+  std::vector<GlobalInfo> Globals;
+  std::vector<int> ArgSpaces;
+  BumpPtrAllocator Strings;
+};
 
-int HLC_ModuleLinkIn(ModuleRef *Dst, ModuleRef *Src) {
-  return !llvm::Linker::LinkModules(Dst->get(), Src->get());
-}
+/// Optimized partitions kept by a session for incremental compiles, as
+/// bitcode keyed by the fingerprint of the partition before optimization.
+/// Holds up to MaxEntries partitions and evicts the least recently used.
+class PartitionCache {
+public:
+  explicit PartitionCache(size_t MaxEntries)
+    : MaxEntries(MaxEntries), Clock(0), Hits(0), Misses(0) { }
+
+  const std::string *lookup(const std::string &Key) {
+    auto It = Entries.find(Key);
+    if (It == Entries.end()) {
+      ++Misses;
+      return nullptr;
+    }
+    ++Hits;
+    It->second.LastUse = ++Clock;
+    return &It->second.Bitcode;
+  }
 
+  void store(const std::string &Key, std::string Bitcode) {
+    if (Entries.size() >= MaxEntries && !Entries.count(Key)) {
+      auto Oldest = Entries.begin();
+      for (auto It = Entries.begin(), E = Entries.end(); It != E; ++It)
+        if (It->second.LastUse < Oldest->second.LastUse)
+          Oldest = It;
+      Entries.erase(Oldest);
+    }
+    Entry &E = Entries[Key];
+    E.Bitcode = std::move(Bitcode);
+    E.LastUse = ++Clock;
+  }
 
-int HLC_ModuleEmitHSAIL(ModuleRef *M, int OptLevel, char **output) {
-  if (OptLevel < 0 && OptLevel > 3) return 0;
-  // Compile
-  std::string buf;
-  raw_string_ostream os(buf);
-  if (!CompileModule(M->get(), os, false, OptLevel)) return 0;
-  // Write output
-  os.flush();
-  *output = HLC_CreateString(buf.c_str());
-  return 1;
-}
+  size_t hits() const { return Hits; }
+  size_t misses() const { return Misses; }
 
-size_t HLC_ModuleEmitBRIG(ModuleRef *M, int OptLevel, char **output) {
-  if (OptLevel < 0 && OptLevel > 3) return 0;
-  // Compile
-  std::string buf;
-  raw_string_ostream os(buf);
-  if (!CompileModule(M->get(), os, true, OptLevel)) return 0;
-  // Write output
-  os.flush();
-  *output = (char*)malloc(buf.size());
-  memcpy(*output, buf.data(), buf.size());
-  return buf.size();
+private:
+  struct Entry {
+    std::string Bitcode;
+    uint64_t LastUse;
+  };
+  std::map<std::string, Entry> Entries;
+  size_t MaxEntries;
+  uint64_t Clock;
+  size_t Hits;
+  size_t Misses;
+};
+
+/// An optimization pipeline configured once and run on many modules.  The
+/// module pass manager, with its TargetLibraryInfo and target analyses, is
+/// built on the first run and kept until the module triple or the command
+/// line changes.  A FunctionPassManager is tied to one module, so only the
+/// function passes are set up per run.  Uses its session's target machines
+/// and must not outlive the session.
+class OptPipeline {
+public:
+  OptPipeline(Session &S, int OptLevel, int SizeLevel, bool Verify)
+    : S(S), OptLevel(OptLevel), SizeLevel(SizeLevel), Verify(Verify) { }
+
+  Session &getSession() { return S; }
+
+  void run(Module *M);
+
+private:
+  void runPasses(Module *M);
+  void runWhole(Module *M);
+  bool runIncremental(Module *M, PartitionCache &Cache);
+  void runFallback(Module *M);
+  void build(const std::string &TheTriple, bool HasDataLayout,
+             unsigned Generation, unsigned OptionsGeneration);
+
+  Session &S;
+  int OptLevel;
+  int SizeLevel;
+  bool Verify;
+
+  // What Passes was built for.
+  std::string BuiltTriple;
+  bool BuiltWithDataLayout = false;
+  unsigned BuiltGeneration = 0;
+  unsigned BuiltOptionsGeneration = 0;
+  SessionOptions BuiltOptions;
+  TargetMachine *TM = nullptr;
+  // The budget of the run in progress, read by the probes in Passes.
+  CompileBudget *Budget = nullptr;
+  std::unique_ptr<PassManager> Passes;
+};
+
+/// A Session owns the LLVMContext its modules are parsed into.  Sessions share
+/// no IR state, so independent kernels can be compiled concurrently as long as
+/// each thread works in its own session.  A single session is not thread-safe.
+class Session {
+public:
+  // Creates a session with a private context.
+  Session() : OwnedContext(new LLVMContext), Context(OwnedContext.get()) {
+    useEmbeddedBuiltins();
+  }
+
+  // Creates a session on top of an existing context.  Used for the default
+  // session backing the session-less C API.
+  explicit Session(LLVMContext &Ctx) : Context(&Ctx) {
+    useEmbeddedBuiltins();
+  }
+
+  // Adopted modules go before the context they live in.
+  ~Session() { destroyModules(); }
+
+  LLVMContext &getContext() { return *Context; }
+
+  bool owns(ModuleRef *M) {
+    return M && *M && &M->get()->getContext() == Context;
+  }
+
+  // Ties M's lifetime to the session: reset() and the session's destruction
+  // destroy it unless HLC_ModuleDestroy did so first.  Returns M.
+  ModuleRef *adopt(ModuleRef *M) {
+    if (M) {
+      M->setOwner(this);
+      Modules.insert(M);
+    }
+    return M;
+  }
+
+  // Hands M back to the caller, who is about to destroy it.
+  void release(ModuleRef *M) {
+    Modules.erase(M);
+    M->setOwner(nullptr);
+  }
+
+  // Copies Data into the session's output arena, NUL-terminated.  The copy
+  // lives until reset() or the end of the session.
+  const char *keepOutput(StringRef Data) {
+    char *Buf = static_cast<char *>(Outputs.Allocate(Data.size() + 1, 1));
+    memcpy(Buf, Data.data(), Data.size());
+    Buf[Data.size()] = '\0';
+    return Buf;
+  }
+
+  // Buffer reused by the scoped emitters to collect output before it is
+  // copied into the arena.
+  SmallVectorImpl<char> &getScratch() { return Scratch; }
+
+  // Destroys every adopted module and scoped output at once.  A session with
+  // a private context also gets a fresh one, releasing the types and constants
+  // the old modules left behind.  Handles into the session are invalidated.
+  void reset() {
+    destroyModules();
+    Outputs.Reset();
+    if (OwnedContext) {
+      BuiltinsModule.reset();
+      OwnedContext.reset(new LLVMContext);
+      Context = OwnedContext.get();
+    }
+  }
+
+  TargetMachineCache &getTargetMachines() { return TargetMachines; }
+
+  // Returns the session's pipeline for these settings, creating it on first
+  // use, so that repeated compiles at one level share the setup.
+  OptPipeline &getOptPipeline(int OptLevel, int SizeLevel, bool Verify) {
+    std::unique_ptr<OptPipeline> &P =
+        OptPipelines[std::make_tuple(OptLevel, SizeLevel, Verify)];
+    if (!P)
+      P.reset(new OptPipeline(*this, OptLevel, SizeLevel, Verify));
+    return *P;
+  }
+
+  // Keeps a private copy of the builtins bitcode for linkBuiltins().
+  bool loadBuiltins(const char *Bitcode, size_t Len) {
+    std::unique_ptr<MemoryBuffer> Copy =
+        MemoryBuffer::getMemBufferCopy(StringRef(Bitcode, Len), "builtins");
+
+    // Make sure it parses before accepting it.
+    std::string Error;
+    std::unique_ptr<Module> Check(ParseLazyBitcode(Copy->getBuffer(), *Context,
+                                                   Error));
+    if (!Check) {
+      errs() << "invalid builtins bitcode: " << Error << "\n";
+      return false;
+    }
+    Builtins.reset(Copy.release());
+    BuiltinsHash = HashString(Builtins->getBuffer());
+    BuiltinsModule = std::move(Check);
+    return true;
+  }
+
+  bool hasBuiltins() const { return Builtins != nullptr; }
+
+  // Identifies the loaded builtins; empty if none are loaded.
+  const std::string &getBuiltinsHash() const { return BuiltinsHash; }
+
+  // Shares Parent's builtins, compile cache and options with this session,
+  // for worker sessions compiling on Parent's behalf.
+  void inherit(const Session &Parent) {
+    Builtins = Parent.Builtins;
+    BuiltinsHash = Parent.BuiltinsHash;
+    BuiltinsModule.reset();
+    Cache = Parent.Cache;
+    setOptions(Parent.Options.get());
+    setBudget(Parent.BudgetBytes, Parent.BudgetSeconds);
+  }
+
+  // Enables the on-disk compile cache in Dir, or disables it if Dir is empty.
+  void setCache(StringRef Dir, uint64_t MaxBytes) {
+    Cache.reset(Dir.empty() ? nullptr : new DiskCache(Dir, MaxBytes));
+  }
+
+  DiskCache *getCache() { return Cache.get(); }
+
+  CompileStats &getStats() { return Stats; }
+
+  ParseTotals &getParseTotals(ParseMode Mode) { return Parses[Mode]; }
+
+  // The settings compiles in this session use.
+  SessionOptions getOptions() const {
+    return Options ? *Options : SessionOptions::fromGlobals();
+  }
+
+  // Gives the session its own settings, or returns it to the global ones if
+  // O is null.
+  void setOptions(const SessionOptions *O) {
+    Options.reset(O ? new SessionOptions(*O) : nullptr);
+    ++OptionsGeneration;
+  }
+
+  // Bumped by setOptions, so pipelines built for older settings are noticed.
+  unsigned getOptionsGeneration() const { return OptionsGeneration; }
+
+  // Enables reuse of optimized partitions across compiles, keeping up to
+  // MaxEntries of them, or disables it if MaxEntries is zero.
+  void setIncremental(size_t MaxEntries) {
+    Partitions.reset(MaxEntries ? new PartitionCache(MaxEntries) : nullptr);
+  }
+
+  PartitionCache *getPartitionCache() { return Partitions.get(); }
+
+  // Soft limits on the resident memory growth and wall time of one
+  // Optimize() call; zero means no limit.  See OptPipeline::run.
+  void setBudget(size_t Bytes, double Seconds) {
+    BudgetBytes = Bytes;
+    BudgetSeconds = Seconds;
+  }
+
+  size_t getBudgetBytes() const { return BudgetBytes; }
+  double getBudgetSeconds() const { return BudgetSeconds; }
+
+  // Highest OptimizePeakBytes of any compile in the session.
+  size_t getPeakBytes() const { return PeakBytes; }
+  void notePeakBytes(size_t Bytes) { PeakBytes = std::max(PeakBytes, Bytes); }
+
+  // Links the builtins needed by Dst into it.  The session keeps a lazily
+  // loaded builtins module whose bodies are read the first time a link needs
+  // them; the linker consumes its source, so each link gets a copy of just the
+  // definitions reachable from Dst's declarations.
+  bool linkBuiltins(Module *Dst) {
+    if (!Builtins) {
+      errs() << "no builtins loaded in this session\n";
+      return false;
+    }
+    PhaseTimer Timer(Stats.LinkSeconds);
+    std::string Error;
+    if (!BuiltinsModule) {
+      BuiltinsModule.reset(ParseLazyBitcode(Builtins->getBuffer(), *Context,
+                                            Error));
+      if (!BuiltinsModule) {
+        errs() << Error << "\n";
+        return false;
+      }
+    }
+
+    std::unique_ptr<Module> Src;
+    if (std::error_code EC = CloneReferenced(BuiltinsModule.get(), Dst, Src)) {
+      errs() << EC.message() << "\n";
+      return false;
+    }
+    if (!Src) {
+      // Not something CloneReferenced handles; prune a fresh copy instead.
+      Src.reset(ParseLazyBitcode(Builtins->getBuffer(), *Context, Error));
+      if (!Src) {
+        errs() << Error << "\n";
+        return false;
+      }
+      if (std::error_code EC = PruneToReferenced(Src.get(), Dst)) {
+        errs() << EC.message() << "\n";
+        return false;
+      }
+    }
+    return !Linker::LinkModules(Dst, Src.get());
+  }
+
+private:
+  // Starts out with the builtins embedded in the library, if any.
+  void useEmbeddedBuiltins() {
+    StringRef Bitcode = GetEmbeddedBuiltins();
+    if (Bitcode.empty())
+      return;
+    Builtins.reset(MemoryBuffer::getMemBuffer(Bitcode, "builtins",
+                                              false).release());
+    BuiltinsHash = GetEmbeddedBuiltinsHash();
+  }
+
+  void destroyModules() {
+    for (ModuleRef *M : Modules) {
+      M->destroy();
+      delete M;
+    }
+    Modules.clear();
+  }
+
+  std::unique_ptr<LLVMContext> OwnedContext;
+  LLVMContext *Context;
+  SmallPtrSet<ModuleRef *, 16> Modules;
+  BumpPtrAllocator Outputs;
+  SmallVector<char, 0> Scratch;
+  TargetMachineCache TargetMachines;
+  // Declared after TargetMachines: the pipelines hold its target machines.
+  std::map<std::tuple<int, int, bool>, std::unique_ptr<OptPipeline>>
+      OptPipelines;
+  // Immutable once loaded, so worker sessions share them.
+  std::shared_ptr<MemoryBuffer> Builtins;
+  std::string BuiltinsHash;
+  // Parsed from Builtins on first use; lives in Context.
+  std::unique_ptr<Module> BuiltinsModule;
+  std::shared_ptr<DiskCache> Cache;
+  size_t BudgetBytes = 0;
+  double BudgetSeconds = 0;
+  size_t PeakBytes = 0;
+  CompileStats Stats = CompileStats();
+  ParseTotals Parses[NumParseModes] = {};
+  std::unique_ptr<SessionOptions> Options;
+  unsigned OptionsGeneration = 0;
+  std::unique_ptr<PartitionCache> Partitions;
+};
+
+// The session behind the original C API; wraps the global context.
+static Session *TheSession = nullptr;
+
+static ModuleRef *ParseInput(LLVMContext &Context, const char *Input,
+                             size_t Len, ParseMode Mode) {
+  switch (Mode) {
+  case ParseAssembly:
+    return ModuleRef::parseAssembly(Input, Context);
+  case ParseBitcode:
+    return ModuleRef::parseBitcode(Input, Len, Context);
+  case ParseBitcodeLazy:
+    return ModuleRef::parseBitcodeLazy(Input, Len, Context);
+  case ParseBitcodeBorrowed: {
+    std::string Error;
+    Module *M = ParseLazyBitcode(StringRef(Input, Len), Context, Error);
+    if (!M) {
+      puts(Error.c_str());
+      return nullptr;
+    }
+    return new ModuleRef(M);
+  }
+  case NumParseModes:
+    break;
+  }
+  return nullptr;
+}
+
+// Parses Input into S's context and records the parse in S's stats.  For
+// the lazy modes the time covers reading the module header and symbol table;
+// bodies are read later, when the passes reach them.
+static ModuleRef *ParseInSession(Session &S, const char *Input, size_t Len,
+                                 ParseMode Mode) {
+  CompileStats &Stats = S.getStats();
+  Stats.InputBytes = Mode == ParseAssembly ? strlen(Input) : Len;
+  Stats.InputFormat = Mode;
+  ModuleRef *M;
+  {
+    PhaseTimer Timer(Stats.ParseSeconds);
+    M = ParseInput(S.getContext(), Input, Len, Mode);
+  }
+  if (M) {
+    ParseTotals &Totals = S.getParseTotals(Mode);
+    Totals.Seconds += Stats.ParseSeconds;
+    ++Totals.Count;
+    Totals.Bytes += Stats.InputBytes;
+  }
+  return M;
+}
+
+/// Output sink supplied by C API callers; receives the output in pieces.
+typedef void (*WriteCallback)(void *Opaque, const char *Data, size_t Len);
+
+/// raw_ostream that writes into a malloc'd buffer.  The buffer is handed to
+/// the C API caller as is, so output is never copied out of a std::string.
+class MallocStream : public raw_ostream {
+public:
+  explicit MallocStream(size_t Reserve = 0)
+    : raw_ostream(/*unbuffered=*/true), Data(nullptr), Size(0), Capacity(0) {
+    grow(Reserve);
+  }
+
+  ~MallocStream() {
+    flush();
+    free(Data);
+  }
+
+  // Hands over the buffer, which the caller releases with free().  It is
+  // NUL-terminated; Len does not count the terminator.
+  char *release(size_t &Len) {
+    flush();
+    grow(Size + 1);
+    Data[Size] = '\0';
+    char *Result = Data;
+    Len = Size;
+    Data = nullptr;
+    Size = Capacity = 0;
+    return Result;
+  }
+
+private:
+  void write_impl(const char *Ptr, size_t Len) override {
+    if (Size + Len > Capacity)
+      grow(std::max(Capacity * 2, Size + Len));
+    memcpy(Data + Size, Ptr, Len);
+    Size += Len;
+  }
+
+  uint64_t current_pos() const override { return Size; }
+
+  void grow(size_t NewCapacity) {
+    if (NewCapacity <= Capacity)
+      return;
+    char *NewData = (char *)realloc(Data, NewCapacity);
+    if (!NewData)
+      report_fatal_error("out of memory while emitting output");
+    Data = NewData;
+    Capacity = NewCapacity;
+  }
+
+  char *Data;
+  size_t Size;
+  size_t Capacity;
+};
+
+/// raw_ostream that writes into a caller-owned buffer of fixed capacity.
+/// Output past the end is dropped but still counted, so tell() reports the
+/// size the caller has to provide.
+class BufferStream : public raw_ostream {
+public:
+  BufferStream(char *Buffer, size_t Capacity)
+    : raw_ostream(/*unbuffered=*/true), Buffer(Buffer), Capacity(Capacity),
+      Pos(0) { }
+
+  ~BufferStream() { flush(); }
+
+private:
+  void write_impl(const char *Ptr, size_t Len) override {
+    if (Pos < Capacity)
+      memcpy(Buffer + Pos, Ptr, std::min(Len, Capacity - Pos));
+    Pos += Len;
+  }
+
+  uint64_t current_pos() const override { return Pos; }
+
+  char *Buffer;
+  size_t Capacity;
+  size_t Pos;
+};
+
+/// raw_ostream that forwards buffered chunks to a WriteCallback.
+class CallbackStream : public raw_ostream {
+public:
+  CallbackStream(WriteCallback Fn, void *Opaque)
+    : Fn(Fn), Opaque(Opaque), Pos(0) { }
+
+  ~CallbackStream() { flush(); }
+
+private:
+  void write_impl(const char *Ptr, size_t Len) override {
+    Fn(Opaque, Ptr, Len);
+    Pos += Len;
+  }
+
+  uint64_t current_pos() const override { return Pos; }
+
+  WriteCallback Fn;
+  void *Opaque;
+  size_t Pos;
+};
+
+CodeGenOpt::Level GetCodeGenOptLevel(int OptLevel) {
+  switch (OptLevel) {
+  case 1:
+    return CodeGenOpt::Less;
+  case 2:
+    return CodeGenOpt::Default;
+  case 3:
+    return CodeGenOpt::Aggressive;
+  default:
+    return CodeGenOpt::None;
+  }
+}
+
+// Sets up Builder for the given optimization level.
+static void ConfigureBuilder(PassManagerBuilder &Builder, unsigned OptLevel,
+                             unsigned SizeLevel,
+                             const SessionOptions &Options) {
+  Builder.OptLevel = OptLevel;
+  Builder.SizeLevel = SizeLevel;
+
+  if (Options.DisableInline) {
+    // No inlining pass
+  } else if (OptLevel > 1) {
+    Builder.Inliner = createFunctionInliningPass(OptLevel, SizeLevel);
+  } else {
+    Builder.Inliner = createAlwaysInlinerPass();
+  }
+  Builder.DisableUnitAtATime = !Options.UnitAtATime;
+  // Builder.DisableUnrollLoops = (DisableLoopUnrolling.getNumOccurrences() > 0) ?
+  //                              DisableLoopUnrolling : OptLevel == 0;
+  Builder.DisableUnrollLoops = OptLevel == 0 || Options.DisableLoopUnrolling;
+
+  // This is final, unless there is a #pragma vectorize enable
+  if (Options.DisableLoopVectorization)
+    Builder.LoopVectorize = false;
+  // If option wasn't forced via cmd line (-vectorize-loops, -loop-vectorize)
+  else if (!Builder.LoopVectorize)
+    Builder.LoopVectorize = OptLevel > 1 && SizeLevel < 2;
+
+  // When #pragma vectorize is on for SLP, do the same as above
+  Builder.SLPVectorize =
+      Options.DisableSLPVectorization ? false : OptLevel > 1 && SizeLevel < 2;
+}
+
+//// Borrowed from LLVM opt.cpp (AddOptimizationPasses)
+/// These routines add optimization passes based on selected optimization
+/// level, OptLevel.  The module and function halves are separate so a module
+/// pass manager can be kept while function pass managers are rebuilt.
+///
+/// OptLevel - Optimization Level
+/// Budget - where the pipeline's owner puts the budget of each run, or null
+static void AddModulePasses(PassManagerBase &MPM, unsigned OptLevel,
+                            unsigned SizeLevel,
+                            const SessionOptions &Options,
+                            CompileBudget *const *Budget = nullptr) {
+  MPM.add(createDebugInfoVerifierPass()); // Verify that debug info is correct
+
+  BudgetedBuilder Builder(Budget);
+  ConfigureBuilder(Builder, OptLevel, SizeLevel, Options);
+  AddBudgetProbes(Builder);
+
+  Builder.populateModulePassManager(MPM);
+}
+
+static void AddFunctionPasses(FunctionPassManager &FPM, unsigned OptLevel,
+                              unsigned SizeLevel,
+                              const SessionOptions &Options,
+                              CompileBudget *const *Budget = nullptr) {
+  FPM.add(createVerifierPass());          // Verify that input is correct
+
+  BudgetedBuilder Builder(Budget);
+  ConfigureBuilder(Builder, OptLevel, SizeLevel, Options);
+  AddBudgetProbes(Builder);
+
+  Builder.populateFunctionPassManager(FPM);
+}
+
+
+// Returns the session's TargetMachine instance or zero if no triple is
+// provided.
+static TargetMachine* GetTargetMachine(Session &S, Triple TheTriple,
+                                       int OptLevel,
+                                       const SessionOptions &Options) {
+  TargetMachineKey Key;
+  Key.Arch = MArch;
+  Key.Triple = TheTriple.getTriple();
+  Key.CPU = Options.CPU;
+  Key.Features = Options.Features;
+  Key.RM = RelocModel;
+  Key.CM = CMModel;
+  Key.OptLevel = GetCodeGenOptLevel(OptLevel);
+  Key.FlagOptions = true;
+  Key.Generation = CommandLineGeneration;
+
+  // Some modules don't specify a triple, and this is okay.
+  std::string Error;
+  return S.getTargetMachines().get(Key, Error);
+}
+
+
+// Serializes M to bitcode.
+static std::string WriteBitcodeToString(const Module *M) {
+  std::string Bitcode;
+  raw_string_ostream os(Bitcode);
+  WriteBitcodeToFile(M, os);
+  os.flush();
+  return Bitcode;
+}
+
+// Whether M can be optimized one root at a time by runIncremental: every
+// symbol is named, and nothing would behave differently when duplicated into
+// several partitions or linked back from them.
+static bool CanPartitionByRoot(Module *M) {
+  if (M->alias_begin() != M->alias_end() ||
+      !M->getComdatSymbolTable().empty() ||
+      M->getNamedMetadata("llvm.dbg.cu") ||
+      !M->getModuleInlineAsm().empty())
+    return false;
+
+  for (Module::iterator F = M->begin(), E = M->end(); F != E; ++F) {
+    if (!F->hasName())
+      return false;
+    if (!F->isDeclaration() &&
+        (F->hasWeakLinkage() || F->hasExternalWeakLinkage()))
+      return false;
+  }
+
+  for (Module::global_iterator G = M->global_begin(), E = M->global_end();
+       G != E; ++G) {
+    if (!G->hasName() || G->hasAppendingLinkage())
+      return false;
+    if (G->isDeclaration())
+      continue;
+    if (G->hasWeakLinkage() || G->hasCommonLinkage())
+      return false;
+    // Local state would be duplicated into every partition.
+    if (G->hasLocalLinkage() && !G->isConstant())
+      return false;
+    // External definitions stay in M, so they must not point at code or data
+    // that moves into the partitions.
+    if (!G->hasLocalLinkage() && !G->isDiscardableIfUnused()) {
+      SmallPtrSet<GlobalValue *, 4> Refs;
+      SmallPtrSet<Constant *, 16> Visited;
+      SmallVector<GlobalValue *, 4> Worklist;
+      CollectGlobalRefs(G->getInitializer(), Refs, Visited, Worklist);
+      if (!Refs.empty())
+        return false;
+    }
+  }
+  return true;
+}
+
+// Copies Root and everything it reaches out of M into a module of its own.
+// Other external functions reached keep their bodies for inlining as
+// available_externally; so do external constants, while external variables
+// become declarations.  Anything unreachable is dropped.
+static Module *ExtractPartition(Module *M, Function *Root) {
+  SmallPtrSet<GlobalValue *, 64> Live;
+  SmallVector<GlobalValue *, 64> Worklist;
+  Live.insert(Root);
+  Worklist.push_back(Root);
+  CollectReachable(Live, Worklist);
+
+  ValueToValueMapTy VMap;
+  Module *Part = CloneLiveSet(M, Live, VMap);
+  for (GlobalValue *GV : Live) {
+    if (GV == Root || GV->isDeclaration() || !GV->hasExternalLinkage())
+      continue;
+    if (GlobalVariable *G = dyn_cast<GlobalVariable>(GV)) {
+      GlobalVariable *PG = cast<GlobalVariable>(VMap[G]);
+      if (G->isConstant())
+        PG->setLinkage(GlobalValue::AvailableExternallyLinkage);
+      else
+        PG->setInitializer(nullptr);
+    } else {
+      cast<GlobalValue>(VMap[GV])->setLinkage(
+          GlobalValue::AvailableExternallyLinkage);
+    }
+  }
+  return Part;
+}
+
+// Prints F without its name, so that two functions can be compared by what
+// they do.  Returns an empty string if F's name can't be found in the text.
+static std::string PrintWithoutName(Function &F) {
+  std::string Text;
+  raw_string_ostream os(Text);
+  F.print(os);
+  os.flush();
+  std::string Name = "@" + F.getName().str() + "(";
+  size_t Pos = Text.find(Name);
+  if (Pos == std::string::npos)
+    return std::string();
+  return Text.substr(Pos + Name.size());
+}
+
+// Linking the partitions of runIncremental back together gives every local
+// function they shared one copy per partition, the linker naming them @f,
+// @f1, @f2 and so on.  Folds each copy whose body came out the same as the
+// first one's into it, repeating until nothing changes since merging callees
+// can make their callers' copies equal too.
+static void MergeLinkedCopies(Module *M) {
+  for (bool Changed = true; Changed;) {
+    Changed = false;
+    std::vector<Function *> Copies;
+    for (Module::iterator F = M->begin(), E = M->end(); F != E; ++F)
+      if (F->hasLocalLinkage() && !F->isDeclaration() &&
+          F->getName() != F->getName().rtrim("0123456789"))
+        Copies.push_back(F);
+
+    for (Function *F : Copies) {
+      Function *First = M->getFunction(F->getName().rtrim("0123456789"));
+      if (!First || !First->hasLocalLinkage() || First->isDeclaration() ||
+          First->getFunctionType() != F->getFunctionType())
+        continue;
+      std::string Text = PrintWithoutName(*F);
+      if (Text.empty() || Text != PrintWithoutName(*First))
+        continue;
+      F->replaceAllUsesWith(First);
+      F->eraseFromParent();
+      Changed = true;
+    }
+  }
+}
+
+// Optimizes M one root (externally visible function) at a time.  Each root is
+// extracted with everything it reaches, and the partition is fingerprinted by
+// its printed IR together with the pipeline settings.  Partitions seen before
+// are taken from Cache instead of being optimized again.  Returns false,
+// leaving M untouched, if M can't be split.
+bool OptPipeline::runIncremental(Module *M, PartitionCache &Cache) {
+  if (!CanPartitionByRoot(M))
+    return false;
+
+  std::vector<Function *> Roots;
+  for (Module::iterator F = M->begin(), E = M->end(); F != E; ++F)
+    if (!F->isDeclaration() && F->hasExternalLinkage())
+      Roots.push_back(F);
+  if (Roots.empty())
+    return false;
+
+  std::string Config;
+  {
+    raw_string_ostream os(Config);
+    os << "opt=" << OptLevel << " size=" << SizeLevel << " verify=" << Verify
+       << " cl=" << BuiltGeneration << " options=";
+    BuiltOptions.print(os);
+    os << "\n";
+  }
+
+  // Get every optimized partition before M is touched.
+  std::vector<std::unique_ptr<Module>> Parts;
+  for (Function *Root : Roots) {
+    std::unique_ptr<Module> Part(ExtractPartition(M, Root));
+    std::string Text = Config;
+    raw_string_ostream os(Text);
+    Part->print(os, nullptr);
+    std::string Key = HashString(os.str());
+
+    if (const std::string *Bitcode = Cache.lookup(Key)) {
+      auto Buf = MemoryBuffer::getMemBuffer(*Bitcode, "", false);
+      ErrorOr<Module *> PartOrErr =
+          parseBitcodeFile(Buf->getMemBufferRef(), M->getContext());
+      if (PartOrErr) {
+        Parts.emplace_back(PartOrErr.get());
+        continue;
+      }
+    }
+    runWhole(Part.get());
+    // Don't cache what a used-up budget cut short.
+    if (Budget && Budget->stopped())
+      return false;
+    Cache.store(Key, WriteBitcodeToString(Part.get()));
+    Parts.push_back(std::move(Part));
+  }
+
+  // Replace M's code with the partitions, keeping the roots in their original
+  // order.  Everything else M defines lives on in the partitions that use it.
+  std::vector<std::string> Order;
+  std::vector<GlobalValue *> Moved;
+  for (Module::iterator F = M->begin(), E = M->end(); F != E; ++F) {
+    if (F->isDeclaration())
+      continue;
+    if (F->hasExternalLinkage()) {
+      Order.push_back(F->getName());
+      F->deleteBody();
+    } else {
+      Moved.push_back(F);
+    }
+  }
+  for (Module::global_iterator G = M->global_begin(), E = M->global_end();
+       G != E; ++G)
+    if (!G->isDeclaration() &&
+        (G->hasLocalLinkage() || G->isDiscardableIfUnused()))
+      Moved.push_back(G);
+  EraseGlobalValues(Moved);
+
+  for (std::unique_ptr<Module> &Part : Parts)
+    if (Linker::LinkModules(M, Part.get()))
+      report_fatal_error("Error linking optimized partition");
+
+  // Collapse what the partitions duplicated: identical copies of shared
+  // helpers and constants are merged, and the copies and available_externally
+  // bodies nothing uses any more are dropped, much as a whole-module compile
+  // would have kept a single helper.
+  MergeLinkedCopies(M);
+  PassManager Cleanup;
+  Cleanup.add(createConstantMergePass());
+  Cleanup.add(createGlobalDCEPass());
+  Cleanup.run(*M);
+
+  for (const std::string &Name : Order)
+    if (Function *F = M->getFunction(Name))
+      M->getFunctionList().splice(M->end(), M->getFunctionList(), F);
+  return true;
+}
+
+void Initialize() {
+  using namespace llvm;
+
+  if ( TheSession != nullptr ) {
+    // Already initialized
+    return;
+  }
+
+  sys::PrintStackTraceOnErrorSignal();
+  EnablePrettyStackTrace();
+
+  // Enable debug stream buffering.
+  EnableDebugBuffering = true;
+
+  TheSession = new Session(getGlobalContext());
+
+  // Initialize targets
+  InitializeAllTargets();
+  InitializeAllTargetMCs();
+  InitializeAllAsmPrinters();
+  InitializeAllAsmParsers();
+
+  // Initialize passes
+  PassRegistry &Registry = *PassRegistry::getPassRegistry();
+  initializeCore(Registry);
+  initializeScalarOpts(Registry);
+  initializeObjCARCOpts(Registry);
+  initializeVectorization(Registry);
+  initializeIPO(Registry);
+  initializeAnalysis(Registry);
+  initializeIPA(Registry);
+  initializeTransformUtils(Registry);
+  initializeInstCombine(Registry);
+  initializeInstrumentation(Registry);
+  initializeTarget(Registry);
+  // For codegen passes, only passes that do IR to IR transformation are
+  // supported.
+  initializeCodeGenPreparePass(Registry);
+  initializeAtomicExpandPass(Registry);
+  initializeRewriteSymbolsPass(Registry);
+
+  initializeCodeGen(Registry);
+  initializeLoopStrengthReducePass(Registry);
+  initializeLowerIntrinsicsPass(Registry);
+  initializeUnreachableBlockElimPass(Registry);
+}
+
+static void ShutdownDefaultCompilePool();
+
+void Finalize() {
+  using namespace llvm;
+
+  // The default pool's workers were set up from TheSession.
+  ShutdownDefaultCompilePool();
+  delete TheSession;
+  TheSession = nullptr;
+
+  llvm_shutdown();
+}
+
+void OptPipeline::build(const std::string &TheTriple, bool HasDataLayout,
+                        unsigned Generation, unsigned OptionsGeneration) {
+  // Free the old passes before asking for the target machine: on a command
+  // line change the session replaces the one they refer to.
+  Passes.reset();
+  TM = nullptr;
+  BuiltTriple = TheTriple;
+  BuiltWithDataLayout = HasDataLayout;
+  BuiltGeneration = Generation;
+  BuiltOptionsGeneration = OptionsGeneration;
+  BuiltOptions = S.getOptions();
+
+  Passes.reset(new PassManager);
+
+  // Add an appropriate TargetLibraryInfo pass for the module's triple.
+  TargetLibraryInfo *TLI = new TargetLibraryInfo(Triple(TheTriple));
+
+  // The -disable-simplify-libcalls flag actually disables all builtin optzns.
+  if (BuiltOptions.DisableSimplifyLibCalls)
+    TLI->disableAllFunctions();
+  Passes->add(TLI);
+
+  // Add an appropriate DataLayout instance.  It reads the layout of each
+  // module it runs on.
+  if (HasDataLayout)
+    Passes->add(new DataLayoutPass());
+
+  Triple ModuleTriple(TheTriple);
+  if (ModuleTriple.getArch())
+    TM = GetTargetMachine(S, ModuleTriple, OptLevel, BuiltOptions);
+
+  // Add internal analysis passes from the target machine.
+  if (TM)
+    TM->addAnalysisPasses(*Passes);
+
+  AddModulePasses(*Passes, OptLevel, SizeLevel, BuiltOptions, &Budget);
+
+  // Check that the module is well formed on completion of optimization
+  if (Verify) {
+    Passes->add(createVerifierPass());
+    Passes->add(createDebugInfoVerifierPass());
+  }
+}
+
+void OptPipeline::run(Module *M) {
+  CompileStats &Stats = S.getStats();
+  PhaseTimer Timer(Stats.OptimizeSeconds);
+
+  bool HasDataLayout = M->getDataLayout() != nullptr;
+  unsigned Generation = CommandLineGeneration;
+  unsigned OptionsGeneration = S.getOptionsGeneration();
+  if (!Passes || M->getTargetTriple() != BuiltTriple ||
+      HasDataLayout != BuiltWithDataLayout || Generation != BuiltGeneration ||
+      OptionsGeneration != BuiltOptionsGeneration)
+    build(M->getTargetTriple(), HasDataLayout, Generation, OptionsGeneration);
+
+  // Lazily loaded bodies aren't counted; they are read as the passes run.
+  Stats.InstructionsBefore = CountInstructions(*M);
+  Stats.OptimizeFallback = 0;
+
+  // A budget is only enforced with a copy of M to fall back on; otherwise
+  // the peak is still recorded.
+  std::unique_ptr<Module> Backup;
+  bool Limited = S.getBudgetBytes() || S.getBudgetSeconds() > 0;
+  if (Limited && OptLevel > 0 && M->getComdatSymbolTable().empty() &&
+      !M->materializeAll())
+    Backup.reset(CloneModule(M));
+  CompileBudget CurrentBudget(Backup ? S.getBudgetBytes() : 0,
+                              Backup ? S.getBudgetSeconds() : 0);
+  CompileActivity Activity;
+
+  Budget = &CurrentBudget;
+  runPasses(M);
+  Budget = nullptr;
+
+  CurrentBudget.record();
+  if (CurrentBudget.stopped()) {
+    // The probes left the rest of the pipeline with nothing to do; start
+    // over from the input with the cheap one.
+    ReplaceModuleContents(M, Backup.get());
+    runFallback(M);
+    Stats.OptimizeFallback = 1;
+  }
+
+  Stats.OptimizePeakBytes = CurrentBudget.peak();
+  S.notePeakBytes(CurrentBudget.peak());
+  Stats.InstructionsAfter = CountInstructions(*M);
+}
+
+// Runs the passes over M, one root at a time when the session caches
+// partitions.
+void OptPipeline::runPasses(Module *M) {
+  // Partitions are fingerprinted by their IR, so everything has to be read.
+  PartitionCache *Cache = S.getPartitionCache();
+  if (Cache && (OptLevel > 0 || SizeLevel > 0) && !M->materializeAll() &&
+      runIncremental(M, *Cache))
+    return;
+  if (Budget && Budget->stopped())
+    return;
+
+  runWhole(M);
+}
+
+// Runs the function and module passes over all of M.
+void OptPipeline::runWhole(Module *M) {
+  if (OptLevel > 0 || SizeLevel > 0) {
+    FunctionPassManager FPasses(M);
+    if (BuiltWithDataLayout)
+      FPasses.add(new DataLayoutPass());
+    if (TM)
+      TM->addAnalysisPasses(FPasses);
+    AddFunctionPasses(FPasses, OptLevel, SizeLevel, BuiltOptions, &Budget);
+
+    FPasses.doInitialization();
+    for (Module::iterator F = M->begin(), E = M->end(); F != E; ++F)
+      FPasses.run(*F);
+    FPasses.doFinalization();
+  }
+
+  // Stop between the pass managers once the budget is used up.
+  if (Budget && Budget->stopped())
+    return;
+
+  // The function passes materialize lazily loaded bodies as they reach them;
+  // read whatever is left before the module passes see it.
+  if (std::error_code EC = M->materializeAll())
+    report_fatal_error("Error reading bitcode file: " + EC.message());
+
+  // Now that we have all of the passes ready, run them.
+  Passes->run(*M);
+}
+
+// The cheap pipeline run when a compile goes over budget: O1 without
+// inlining or loop unrolling, built for this one run.
+void OptPipeline::runFallback(Module *M) {
+  SessionOptions Options = BuiltOptions;
+  Options.DisableInline = true;
+  Options.DisableLoopUnrolling = true;
+
+  FunctionPassManager FPasses(M);
+  if (BuiltWithDataLayout)
+    FPasses.add(new DataLayoutPass());
+  if (TM)
+    TM->addAnalysisPasses(FPasses);
+  AddFunctionPasses(FPasses, 1, 0, Options);
+
+  FPasses.doInitialization();
+  for (Module::iterator F = M->begin(), E = M->end(); F != E; ++F)
+    FPasses.run(*F);
+  FPasses.doFinalization();
+
+  PassManager MPasses;
+  TargetLibraryInfo *TLI = new TargetLibraryInfo(Triple(BuiltTriple));
+  if (Options.DisableSimplifyLibCalls)
+    TLI->disableAllFunctions();
+  MPasses.add(TLI);
+  if (BuiltWithDataLayout)
+    MPasses.add(new DataLayoutPass());
+  if (TM)
+    TM->addAnalysisPasses(MPasses);
+  AddModulePasses(MPasses, 1, 0, Options);
+  if (Verify)
+    MPasses.add(createVerifierPass());
+  MPasses.run(*M);
+}
+
+void Optimize(Session &S, llvm::Module *M, int OptLevel, int SizeLevel,
+              int Verify) {
+  S.getOptPipeline(OptLevel, SizeLevel, Verify != 0).run(M);
+}
+
+// Runs the passes named in Pipeline over M, in that order.  Names are the
+// ones opt takes, separated by commas, e.g. "mem2reg,instcombine,gvn".  An
+// unknown name, or a pass that can't be created on its own, fails before
+// anything runs.
+static bool RunNamedPasses(Session &S, Module *M, StringRef Pipeline) {
+  PassRegistry &Registry = *PassRegistry::getPassRegistry();
+  std::vector<std::unique_ptr<Pass>> Passes;
+  while (!Pipeline.empty()) {
+    std::pair<StringRef, StringRef> Split = Pipeline.split(',');
+    StringRef Name = Split.first.trim();
+    Pipeline = Split.second;
+    if (Name.empty())
+      continue;
+    const PassInfo *PI = Registry.getPassInfo(Name);
+    if (!PI) {
+      errs() << "unknown pass: " << Name << "\n";
+      return false;
+    }
+    if (!PI->getNormalCtor()) {
+      errs() << "pass cannot be created on its own: " << Name << "\n";
+      return false;
+    }
+    Passes.emplace_back(PI->createPass());
+  }
+
+  CompileStats &Stats = S.getStats();
+  PhaseTimer Timer(Stats.OptimizeSeconds);
+  Stats.InstructionsBefore = CountInstructions(*M);
+
+  SessionOptions Options = S.getOptions();
+  PassManager PM;
+  Triple TheTriple(M->getTargetTriple());
+  TargetLibraryInfo *TLI = new TargetLibraryInfo(TheTriple);
+  if (Options.DisableSimplifyLibCalls)
+    TLI->disableAllFunctions();
+  PM.add(TLI);
+  if (M->getDataLayout())
+    PM.add(new DataLayoutPass());
+  // The target machine only provides analyses here, such as the cost model.
+  if (TheTriple.getArch())
+    if (TargetMachine *TM = GetTargetMachine(S, TheTriple, 2, Options))
+      TM->addAnalysisPasses(PM);
+  for (std::unique_ptr<Pass> &P : Passes)
+    PM.add(P.release());
+  PM.run(*M);
+
+  Stats.InstructionsAfter = CountInstructions(*M);
+  return true;
+}
+
+// Internalizes everything in M except the functions named in Entries and
+// deletes whatever they can't reach, so that unused builtins never get to
+// codegen.  With no names, the spir_kernel definitions are the entry points.
+// Returns false, leaving M untouched, if none of the entry points is defined
+// in M, since everything would be deleted.
+static bool StripDeadCode(Module *M, ArrayRef<const char *> Entries) {
+  std::vector<std::string> Names(Entries.begin(), Entries.end());
+  if (Names.empty())
+    for (Module::iterator F = M->begin(), E = M->end(); F != E; ++F)
+      if (!F->isDeclaration() &&
+          F->getCallingConv() == CallingConv::SPIR_KERNEL)
+        Names.push_back(F->getName());
+
+  bool HasEntry = false;
+  for (const std::string &Name : Names)
+    if (GlobalValue *GV = M->getNamedValue(Name))
+      HasEntry |= !GV->isDeclaration();
+  if (!HasEntry) {
+    errs() << "no entry point to keep is defined in the module\n";
+    return false;
+  }
+
+  std::vector<const char *> Exports;
+  for (const std::string &Name : Names)
+    Exports.push_back(Name.c_str());
+
+  PassManager PM;
+  PM.add(createInternalizePass(Exports));
+  PM.add(createGlobalDCEPass());
+  PM.run(*M);
+  return true;
+}
+
+// Whether any function that calls F directly is marked cold.
+static bool HasColdCaller(Function *F) {
+  for (User *U : F->users()) {
+    CallSite CS(U);
+    if (CS && CS.getCalledFunction() == F &&
+        CS.getInstruction()->getParent()->getParent()->hasFnAttribute(
+            Attribute::Cold))
+      return true;
+  }
+  return false;
+}
+
+// Applies a profile's verdict on F.  Hot functions (Hotness > 0) get an
+// inline hint, as do the functions they call directly, so the inliner works
+// harder on them; the hint is a function attribute and so applies at every
+// call site, which is why callees that are cold or have a cold caller don't
+// get it.  Cold functions are marked cold and optimized for size, which
+// lowers the inline and unroll thresholds and skips vectorization.
+static void SetFunctionHotness(Function *F, int Hotness) {
+  if (Hotness > 0) {
+    F->removeFnAttr(Attribute::Cold);
+    F->removeFnAttr(Attribute::OptimizeForSize);
+    F->addFnAttr(Attribute::InlineHint);
+    for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I) {
+      CallSite CS(&*I);
+      if (!CS)
+        continue;
+      Function *Callee = CS.getCalledFunction();
+      if (Callee && !Callee->isDeclaration() &&
+          !Callee->hasFnAttribute(Attribute::NoInline) &&
+          !Callee->hasFnAttribute(Attribute::Cold) && !HasColdCaller(Callee))
+        Callee->addFnAttr(Attribute::InlineHint);
+    }
+  } else if (Hotness < 0) {
+    F->removeFnAttr(Attribute::InlineHint);
+    F->addFnAttr(Attribute::Cold);
+    F->addFnAttr(Attribute::OptimizeForSize);
+  }
+}
+
+// Returns block Index (in function order) of the function Name in M, or null.
+static BasicBlock *GetBlock(Module *M, const char *Name, unsigned Index) {
+  Function *F = M->getFunction(Name);
+  if (!F || Index >= F->size())
+    return nullptr;
+  Function::iterator BB = F->begin();
+  std::advance(BB, Index);
+  return BB;
+}
+
+// Puts profiled branch weights on the terminator of BB, one per successor.
+static bool SetBranchWeights(BasicBlock *BB, ArrayRef<uint32_t> Weights) {
+  TerminatorInst *TI = BB->getTerminator();
+  if (!TI || TI->getNumSuccessors() < 2 ||
+      TI->getNumSuccessors() != Weights.size())
+    return false;
+  MDBuilder MDB(BB->getContext());
+  TI->setMetadata(LLVMContext::MD_prof, MDB.createBranchWeights(Weights));
+  return true;
+}
+
+// Asks the loop unroller to unroll the loop headed by Header Count times, in
+// place of its own size-based estimate.  The other properties of the loop's
+// llvm.loop node are kept.  Returns false if Header heads no loop.
+static bool SetLoopUnrollCount(BasicBlock *Header, unsigned Count) {
+  Function *F = Header->getParent();
+  DominatorTree DT;
+  DT.recalculate(*F);
+  SmallVector<BasicBlock *, 2> Latches;
+  for (pred_iterator PI = pred_begin(Header), PE = pred_end(Header);
+       PI != PE; ++PI)
+    if (DT.dominates(Header, *PI))
+      Latches.push_back(*PI);
+  if (Latches.empty())
+    return false;
+
+  LLVMContext &Ctx = F->getContext();
+  SmallVector<Metadata *, 4> MDs;
+  MDs.push_back(nullptr); // the loop ID refers to itself
+  for (BasicBlock *Latch : Latches) {
+    MDNode *Old = Latch->getTerminator()->getMetadata(LLVMContext::MD_loop);
+    if (!Old)
+      continue;
+    for (unsigned i = 1, e = Old->getNumOperands(); i < e; ++i) {
+      MDNode *Op = dyn_cast<MDNode>(Old->getOperand(i));
+      MDString *Key = Op && Op->getNumOperands()
+                          ? dyn_cast<MDString>(Op->getOperand(0))
+                          : nullptr;
+      if (Key && Key->getString() == "llvm.loop.unroll.count")
+        continue;
+      MDs.push_back(Old->getOperand(i));
+    }
+    break;
+  }
+  Metadata *Unroll[] = {
+    MDString::get(Ctx, "llvm.loop.unroll.count"),
+    ConstantAsMetadata::get(ConstantInt::get(Type::getInt32Ty(Ctx), Count))
+  };
+  MDs.push_back(MDNode::get(Ctx, Unroll));
+
+  MDNode *LoopID = MDNode::get(Ctx, MDs);
+  LoopID->replaceOperandWith(0, LoopID);
+  // All latches carry the same ID, or the loop has none.
+  for (BasicBlock *Latch : Latches)
+    Latch->getTerminator()->setMetadata(LLVMContext::MD_loop, LoopID);
+  return true;
+}
+
+static const std::string MArch = "hsail64";
+
+// Returns the session's TargetMachine for generating code for mod, or zero if
+// the target is unavailable.  The module picks up the target's data layout.
+static TargetMachine *GetCodegenTarget(Session &S, Module *mod, int OptLevel) {
+  // Load the module to be compiled...
+  SMDiagnostic Err;
+
+  Triple TheTriple;
+
+  TheTriple = Triple(mod->getTargetTriple());
+
+  if (TheTriple.getTriple().empty())
+    TheTriple.setTriple(sys::getDefaultTargetTriple());
+
+  // The session's CPU and features reach the subtarget, as they do for the
+  // optimizer's target.
+  SessionOptions Options = S.getOptions();
+
+  TargetMachineKey Key;
+  Key.Arch = MArch;
+  Key.Triple = TheTriple.getTriple();
+  Key.CPU = Options.CPU;
+  Key.Features = Options.Features;
+  Key.RM = RelocModel;
+  Key.CM = CMModel;
+  Key.OptLevel = GetCodeGenOptLevel(OptLevel);
+  Key.FlagOptions = false;
+  Key.Generation = CommandLineGeneration;
+
+  // Get the target machine, reusing the session's instance when possible.
+  std::string Error;
+  TargetMachine *target = S.getTargetMachines().get(Key, Error);
+  if (!target) {
+    errs() << Error;
+    return nullptr;
+  }
+  assert(mod && "Should have exited if we didn't have a module!");
+
+  // Add the target data from the target machine, if it exists, or the module.
+  if (const DataLayout *DL = target->getSubtargetImpl()->getDataLayout())
+    mod->setDataLayout(DL);
+
+  return target;
+}
+
+enum OutputKind { OutputHSAIL, OutputBRIG };
+
+// formatted_raw_ostream that hands its buffer straight to the underlying
+// stream.  The object writer never asks for a column, so BRIG output can skip
+// the per-byte position scan done for assembly text.
+class BRIGStream : public formatted_raw_ostream {
+public:
+  explicit BRIGStream(raw_ostream &OS) : OS(OS) { }
+  // Flush here, while write_impl still refers to this class.
+  ~BRIGStream() { flush(); }
+
+private:
+  void write_impl(const char *Ptr, size_t Size) override {
+    OS.write(Ptr, Size);
+  }
+
+  uint64_t current_pos() const override { return OS.tell(); }
+
+  raw_ostream &OS;
+};
+
+// Per output kind: the file type asked of the target, the stream it writes
+// through and where its timing and size end up in CompileStats.
+template <OutputKind Kind> struct OutputTraits;
+
+template <> struct OutputTraits<OutputHSAIL> {
+  typedef formatted_raw_ostream Stream;
+  static const TargetMachine::CodeGenFileType FileType =
+      TargetMachine::CGFT_AssemblyFile;
+  static double &seconds(CompileStats &S) { return S.HSAILSeconds; }
+  static size_t &bytes(CompileStats &S) { return S.HSAILBytes; }
+};
+
+template <> struct OutputTraits<OutputBRIG> {
+  typedef BRIGStream Stream;
+  static const TargetMachine::CodeGenFileType FileType =
+      TargetMachine::CGFT_ObjectFile;
+  static double &seconds(CompileStats &S) { return S.BRIGSeconds; }
+  static size_t &bytes(CompileStats &S) { return S.BRIGBytes; }
+};
+
+// Runs the backend for Target on mod, writing the output of kind Kind to os.
+template <OutputKind Kind>
+static int RunCodegen(Session &S, TargetMachine &Target, Module *mod,
+                      raw_ostream &os) {
+  typedef OutputTraits<Kind> Traits;
+  CompileActivity Activity;
+  CompileStats &Stats = S.getStats();
+  uint64_t StartPos = os.tell();
+  PhaseTimer Timer(Traits::seconds(Stats));
+
+  // Build up all of the passes that we want to do to the module.
+  PassManager PM;
+
+  // Add an appropriate TargetLibraryInfo pass for the module's triple.
+  TargetLibraryInfo *TLI =
+      new TargetLibraryInfo(Triple(Target.getTargetTriple()));
+  if (S.getOptions().DisableSimplifyLibCalls)
+    TLI->disableAllFunctions();
+  PM.add(TLI);
+
+  PM.add(new DataLayoutPass());
+
+  {
+    typename Traits::Stream FOS(os);
+
+    // Ask the target to add backend passes as necessary.
+    bool Verify = false;
+    if (Target.addPassesToEmitFile(PM, FOS, Traits::FileType, Verify)) {
+      errs() << "target does not support generation of this"
+             << " file type!\n";
+      return 0;
+    }
+
+    PM.run(*mod);
+  }
+
+  Traits::bytes(Stats) = os.tell() - StartPos;
+  return 1;
+}
+
+// The following function is adapted from llc.cpp
+int CompileModule(Session &S, Module *mod, raw_ostream &os,
+                  bool emitBRIG, int OptLevel) {
+  TargetMachine *Target = GetCodegenTarget(S, mod, OptLevel);
+  if (!Target) return 0;
+  if (emitBRIG)
+    return RunCodegen<OutputBRIG>(S, *Target, mod, os);
+  return RunCodegen<OutputHSAIL>(S, *Target, mod, os);
+}
+
+// Checks the arguments of an emit call and compiles M into os.  Returns the
+// number of bytes written, or zero on failure.
+static size_t EmitModule(Session &S, ModuleRef *M, bool emitBRIG, int OptLevel,
+                         raw_ostream &os) {
+  if (OptLevel < 0 || OptLevel > 3) return 0;
+  if (!S.owns(M)) return 0;
+  if (!M->materialize()) return 0;
+  // File streams start at the descriptor's offset, so count from here.
+  uint64_t Start = os.tell();
+  if (!CompileModule(S, M->get(), os, emitBRIG, OptLevel)) return 0;
+  os.flush();
+  return os.tell() - Start;
+}
+
+// Emits M to the open descriptor FD, which is left open.  Returns the number
+// of bytes written, or zero on failure.
+static size_t EmitModuleToFD(Session &S, ModuleRef *M, bool emitBRIG,
+                             int OptLevel, int FD) {
+  raw_fd_ostream os(FD, /*shouldClose=*/false);
+  size_t Len = EmitModule(S, M, emitBRIG, OptLevel, os);
+  if (os.has_error()) {
+    errs() << "error writing output\n";
+    os.clear_error();
+    return 0;
+  }
+  return Len;
+}
+
+// Emits M to Path.  The output goes to a temporary file next to Path that is
+// renamed over it once complete, so readers never see a partial file.
+static size_t EmitModuleToPath(Session &S, ModuleRef *M, bool emitBRIG,
+                               int OptLevel, const char *Path) {
+  int FD;
+  SmallString<128> TmpPath;
+  if (std::error_code EC =
+          sys::fs::createUniqueFile(Twine(Path) + ".tmp-%%%%%%%%", FD,
+                                    TmpPath)) {
+    errs() << Path << ": " << EC.message() << "\n";
+    return 0;
+  }
+
+  size_t Len;
+  {
+    raw_fd_ostream os(FD, /*shouldClose=*/true);
+    Len = EmitModule(S, M, emitBRIG, OptLevel, os);
+    os.close();
+    if (os.has_error()) {
+      errs() << TmpPath << ": error writing output\n";
+      os.clear_error();
+      Len = 0;
+    }
+  }
+  if (Len) {
+    if (std::error_code EC = sys::fs::rename(TmpPath, Path)) {
+      errs() << Path << ": " << EC.message() << "\n";
+      Len = 0;
+    }
+  }
+  if (!Len)
+    sys::fs::remove(TmpPath);
+  return Len;
+}
+
+// Writes M to os as bitcode.  Returns the number of bytes written, or zero if
+// its lazy bodies could not be read.
+static size_t WriteModuleBitcode(ModuleRef *M, raw_ostream &os) {
+  if (!M->materialize()) return 0;
+  uint64_t Start = os.tell();
+  WriteBitcodeToFile(M->get(), os);
+  os.flush();
+  return os.tell() - Start;
+}
+
+/// Flags for CompilePipeline (the Flags argument of HLC_SessionCompile).
+enum CompileFlags {
+  CompileLinkBuiltins = 1 << 0, // Link the session's builtins.
+  CompileEmitHSAIL    = 1 << 1, // Produce HSAIL text.
+  CompileEmitBRIG     = 1 << 2, // Produce BRIG.
+  CompileVerify       = 1 << 3, // Verify the module after optimization.
+  CompileStripDead    = 1 << 4, // Keep only what the kernels reach.
+};
+
+// Computes the compile cache key of a CompilePipeline call.
+static std::string GetCacheKey(Session &S, StringRef Input, int OptLevel,
+                               int SizeLevel, unsigned Flags) {
+  std::string Key;
+  raw_string_ostream os(Key);
+  os << "libHLC/" << LLVM_VERSION_MAJOR << "." << LLVM_VERSION_MINOR
+     << " opt=" << OptLevel << " size=" << SizeLevel << " flags=" << Flags;
+  if (Flags & CompileLinkBuiltins)
+    os << " builtins=" << S.getBuiltinsHash();
+  os << " options=";
+  S.getOptions().print(os);
+  // An over-budget compile isn't cached, but budgets still change which
+  // compiles can fall back.
+  os << " budget=" << S.getBudgetBytes() << "," << S.getBudgetSeconds();
+  // Incremental mode links the output together from partitions.
+  os << " incremental=" << (S.getPartitionCache() != nullptr);
+  {
+    std::lock_guard<std::mutex> Guard(CommandLineLock);
+    os << " cl=" << HashString(CommandLineState);
+  }
+  os << " input=" << HashString(Input);
+  return HashString(os.str());
+}
+
+static bool CompilePipelineUncached(Session &S, const char *Input, size_t Len,
+                                    int OptLevel, int SizeLevel,
+                                    unsigned Flags, CompileOutput &Out);
+
+// Parses Input, links the builtins, optimizes and emits the formats selected
+// by Flags in one go.  Goes through the session's compile cache if enabled.
+static bool CompilePipeline(Session &S, const char *Input, size_t Len,
+                            int OptLevel, int SizeLevel, unsigned Flags,
+                            CompileOutput &Out) {
+  S.getStats() = CompileStats();
+
+  DiskCache *Cache = S.getCache();
+  if (!Cache)
+    return CompilePipelineUncached(S, Input, Len, OptLevel, SizeLevel, Flags,
+                                   Out);
+
+  const unsigned char *Ptr = reinterpret_cast<const unsigned char *>(Input);
+  StringRef Data = isBitcode(Ptr, Ptr + Len) ? StringRef(Input, Len)
+                                             : StringRef(Input);
+  std::string Key = GetCacheKey(S, Data, OptLevel, SizeLevel, Flags);
+  if (Cache->lookup(Key, Out))
+    return true;
+  if (!CompilePipelineUncached(S, Input, Len, OptLevel, SizeLevel, Flags, Out))
+    return false;
+  // Output of the over-budget fallback pipeline must not stand in for the
+  // real thing in later compiles.
+  if (!S.getStats().OptimizeFallback)
+    Cache->store(Key, Out);
+  return true;
+}
+
+// Does the work of CompilePipeline.  Input is bitcode or NUL-terminated
+// assembly.  Both outputs share a single target setup; BRIG is generated
+// first so it matches what HLC_ModuleEmitBRIG produces for the optimized
+// module.
+static bool CompilePipelineUncached(Session &S, const char *Input, size_t Len,
+                                    int OptLevel, int SizeLevel,
+                                    unsigned Flags, CompileOutput &Out) {
+  if (OptLevel < 0 || OptLevel > 3) return false;
+  if (SizeLevel < 0 || SizeLevel > 2) return false;
+
+  const unsigned char *Ptr = reinterpret_cast<const unsigned char *>(Input);
+  std::unique_ptr<ModuleRef> Ref(
+      ParseInSession(S, Input, Len,
+                     isBitcode(Ptr, Ptr + Len) ? ParseBitcode : ParseAssembly));
+  if (!Ref) return false;
+  std::unique_ptr<Module> M(Ref->get());
+
+  if ((Flags & CompileLinkBuiltins) && !S.linkBuiltins(M.get()))
+    return false;
+
+  if ((Flags & CompileStripDead) && !StripDeadCode(M.get(), None))
+    return false;
+
+  Optimize(S, M.get(), OptLevel, SizeLevel, Flags & CompileVerify);
+
+  TargetMachine *Target = GetCodegenTarget(S, M.get(), OptLevel);
+  if (!Target) return false;
+
+  if (Flags & CompileEmitBRIG) {
+    MallocStream os;
+    if (!RunCodegen<OutputBRIG>(S, *Target, M.get(), os)) return false;
+    Out.BRIG = os.release(Out.BRIGSize);
+  }
+  if (Flags & CompileEmitHSAIL) {
+    MallocStream os;
+    if (!RunCodegen<OutputHSAIL>(S, *Target, M.get(), os)) return false;
+    Out.HSAIL = os.release(Out.HSAILSize);
+  }
+  return true;
+}
+
+/// Flags accepted by HLC_CreateOptPipeline.
+enum OptPipelineFlags {
+  OptPipelineVerify = 1 << 0, // Verify the module after optimization.
+};
+
+/// Inputs and results of CompileBatch, indexed by input.
+struct BatchJob {
+  const char *const *Inputs;
+  const size_t *Lens;
+  int OptLevel;
+  int SizeLevel;
+  unsigned Flags;
+  size_t Count;
+  std::unique_ptr<CompileOutput[]> Outputs;
+  std::unique_ptr<bool[]> Ok;
+  std::atomic<size_t> Next;
+};
+
+// Compiles inputs from Job in S until none are left.
+static void CompileBatchWorker(Session &S, BatchJob &Job) {
+  for (size_t i = Job.Next++; i < Job.Count; i = Job.Next++)
+    Job.Ok[i] = CompilePipeline(S, Job.Inputs[i], Job.Lens[i], Job.OptLevel,
+                                Job.SizeLevel, Job.Flags, Job.Outputs[i]);
+}
+
+// Compiles every input of Job.  The calling thread works in S, so a serial
+// batch reuses S's target machines; the NumThreads - 1 helpers each get a
+// worker session sharing S's builtins and cache.
+static void CompileBatch(Session &S, BatchJob &Job, unsigned NumThreads) {
+  NumThreads = std::max<size_t>(1, std::min<size_t>(NumThreads, Job.Count));
+  std::vector<std::thread> Helpers;
+  for (unsigned i = 1; i < NumThreads; ++i)
+    Helpers.emplace_back([&S, &Job]() {
+      Session Worker;
+      Worker.inherit(S);
+      CompileBatchWorker(Worker, Job);
+    });
+  CompileBatchWorker(S, Job);
+  for (std::thread &T : Helpers)
+    T.join();
+}
+
+// Keeps only the entries of the opencl.kernels list that describe Kernel.
+static void FilterKernelMetadata(Module *M, const Function *Kernel) {
+  NamedMDNode *Kernels = M->getNamedMetadata("opencl.kernels");
+  if (!Kernels)
+    return;
+  SmallVector<MDNode *, 1> Keep;
+  for (unsigned i = 0, e = Kernels->getNumOperands(); i != e; ++i) {
+    MDNode *N = Kernels->getOperand(i);
+    if (N->getNumOperands() &&
+        mdconst::dyn_extract_or_null<Function>(N->getOperand(0)) == Kernel)
+      Keep.push_back(N);
+  }
+  Kernels->dropAllReferences();
+  for (MDNode *N : Keep)
+    Kernels->addOperand(N);
+}
+
+// Whether MD, and every node it reaches, only refers to symbols VMap maps.
+static bool RefersOnlyToMapped(const Metadata *MD, ValueToValueMapTy &VMap,
+                               SmallPtrSetImpl<const Metadata *> &Visited) {
+  if (!MD || !Visited.insert(MD).second)
+    return true;
+  if (const ValueAsMetadata *V = dyn_cast<ValueAsMetadata>(MD)) {
+    SmallPtrSet<GlobalValue *, 4> Refs;
+    SmallPtrSet<Constant *, 16> Seen;
+    SmallVector<GlobalValue *, 4> Worklist;
+    CollectGlobalRefs(V->getValue(), Refs, Seen, Worklist);
+    for (GlobalValue *GV : Refs)
+      if (!VMap.count(GV))
+        return false;
+    return true;
+  }
+  if (const MDNode *N = dyn_cast<MDNode>(MD))
+    for (const MDOperand &Op : N->operands())
+      if (!RefersOnlyToMapped(Op.get(), VMap, Visited))
+        return false;
+  return true;
+}
+
+// Copies the named metadata of Src into Dst, which CloneLiveSet made from Src
+// with VMap, leaving out the entries that refer to symbols Dst doesn't have.
+static void CloneNamedMetadata(Module *Src, Module *Dst,
+                               ValueToValueMapTy &VMap) {
+  for (Module::named_metadata_iterator I = Src->named_metadata_begin(),
+       E = Src->named_metadata_end(); I != E; ++I) {
+    NamedMDNode *N = Dst->getOrInsertNamedMetadata(I->getName());
+    for (unsigned i = 0, e = I->getNumOperands(); i != e; ++i) {
+      SmallPtrSet<const Metadata *, 16> Visited;
+      if (RefersOnlyToMapped(I->getOperand(i), VMap, Visited))
+        N->addOperand(MapMetadata(I->getOperand(i), VMap));
+    }
+  }
+}
+
+// Splits M into one module per kernel definition, written to Parts as
+// bitcode so other contexts can compile them.  Each part gets a copy of its
+// kernel's live set, with the kernel externally visible; helpers used by
+// several kernels are copied into each part and internalized.  Returns false
+// if M has no kernels or splitting it would change what the kernels see:
+// aliases, or a mutable global that more than one kernel reaches.  Group
+// memory (address space 3), such as the work_group builtins' __wg_scratch, is
+// exempt since every work-group gets its own.
+static bool SplitByKernel(Module *M, std::vector<std::string> &Names,
+                          std::vector<std::string> &Parts) {
+  if (M->alias_begin() != M->alias_end() ||
+      !M->getModuleInlineAsm().empty())
+    return false;
+  if (M->materializeAll())
+    return false;
+
+  std::vector<Function *> Kernels;
+  for (Module::iterator F = M->begin(), E = M->end(); F != E; ++F)
+    if (!F->isDeclaration() &&
+        F->getCallingConv() == CallingConv::SPIR_KERNEL)
+      Kernels.push_back(F);
+  if (Kernels.empty())
+    return false;
+
+  std::vector<SmallPtrSet<GlobalValue *, 64>> Lives(Kernels.size());
+  SmallPtrSet<GlobalVariable *, 16> Shared;
+  for (size_t i = 0; i != Kernels.size(); ++i) {
+    SmallPtrSetImpl<GlobalValue *> &Live = Lives[i];
+    SmallVector<GlobalValue *, 64> Worklist;
+    Live.insert(Kernels[i]);
+    Worklist.push_back(Kernels[i]);
+    CollectReachable(Live, Worklist);
+    for (GlobalValue *GV : Live) {
+      GlobalVariable *Var = dyn_cast<GlobalVariable>(GV);
+      if (Var && Var->hasInitializer() && !Var->isConstant() &&
+          Var->getType()->getAddressSpace() != 3 &&
+          !Shared.insert(Var).second)
+        return false;
+    }
+  }
+
+  // Debug info ties every function to the compile unit, so a debug module
+  // can't be cut down to a live set; its parts are whole clones that
+  // StripDeadCode trims.
+  bool HasDebugInfo = M->getNamedMetadata("llvm.dbg.cu");
+  for (size_t i = 0; i != Kernels.size(); ++i) {
+    Function *Kernel = Kernels[i];
+    ValueToValueMapTy VMap;
+    std::unique_ptr<Module> Part;
+    if (HasDebugInfo) {
+      Part.reset(CloneModule(M, VMap));
+    } else {
+      Part.reset(CloneLiveSet(M, Lives[i], VMap));
+      CloneNamedMetadata(M, Part.get(), VMap);
+    }
+    FilterKernelMetadata(Part.get(), cast<Function>(VMap[Kernel]));
+    std::string Name = Kernel->getName();
+    const char *Entry = Name.c_str();
+    StripDeadCode(Part.get(), Entry);
+    Names.push_back(Name);
+    Parts.push_back(WriteBitcodeToString(Part.get()));
+  }
+  return true;
+}
+
+/// Per-kernel BRIG generation for the parts made by SplitByKernel.
+struct KernelJob {
+  int OptLevel;
+  std::vector<std::string> Parts;
+  std::unique_ptr<CompileOutput[]> Outputs;
+  std::unique_ptr<bool[]> Ok;
+  std::atomic<size_t> Next;
+};
+
+// Generates BRIG for parts from Job in S until none are left.
+static void CompileKernelWorker(Session &S, KernelJob &Job) {
+  for (size_t i = Job.Next++; i < Job.Parts.size(); i = Job.Next++) {
+    auto Buf = MemoryBuffer::getMemBuffer(Job.Parts[i], "", false);
+    ErrorOr<Module *> PartOrErr =
+        parseBitcodeFile(Buf->getMemBufferRef(), S.getContext());
+    if (std::error_code EC = PartOrErr.getError()) {
+      errs() << EC.message() << "\n";
+      continue;
+    }
+    std::unique_ptr<Module> Part(PartOrErr.get());
+    TargetMachine *Target = GetCodegenTarget(S, Part.get(), Job.OptLevel);
+    if (!Target)
+      continue;
+    MallocStream os;
+    if (!RunCodegen<OutputBRIG>(S, *Target, Part.get(), os))
+      continue;
+    CompileOutput &Out = Job.Outputs[i];
+    Out.BRIG = os.release(Out.BRIGSize);
+    Job.Ok[i] = true;
+  }
+}
+
+// Generates BRIG for every part of Job, like CompileBatch: the calling thread
+// works in S and the NumThreads - 1 helpers in worker sessions inheriting it.
+static bool CompileKernels(Session &S, KernelJob &Job, unsigned NumThreads) {
+  CompileStats &Stats = S.getStats();
+  {
+    PhaseTimer Timer(Stats.BRIGSeconds);
+    NumThreads = std::max<size_t>(1, std::min<size_t>(NumThreads,
+                                                      Job.Parts.size()));
+    std::vector<std::thread> Helpers;
+    for (unsigned i = 1; i < NumThreads; ++i)
+      Helpers.emplace_back([&S, &Job]() {
+        Session Worker;
+        Worker.inherit(S);
+        CompileKernelWorker(Worker, Job);
+      });
+    CompileKernelWorker(S, Job);
+    for (std::thread &T : Helpers)
+      T.join();
+  }
+
+  Stats.BRIGBytes = 0;
+  for (size_t i = 0; i != Job.Parts.size(); ++i) {
+    if (!Job.Ok[i])
+      return false;
+    Stats.BRIGBytes += Job.Outputs[i].BRIGSize;
+  }
+  return true;
+}
+
+/// Called on a pool thread when a ticket's compile has finished.
+typedef void (*CompileCallback)(void *Opaque, struct CompileTicket *Ticket,
+                                int Ok);
+
+/// One compile submitted to a CompilePool.  Shared by the pool and the caller,
+/// and deleted when both have released it.
+struct CompileTicket {
+  std::string Input; // NUL-terminated copy of the caller's input
+  int OptLevel;
+  int SizeLevel;
+  unsigned Flags;
+  CompileCallback Fn;
+  void *Opaque;
+
+  std::mutex Lock;
+  std::condition_variable Finished;
+  bool Compiled = false; // Ok and Out are final
+  bool Done = false;     // and Fn has returned
+  bool Ok = false;
+  CompileOutput Out;
+  std::thread::id CallbackThread; // the pool thread that runs Fn
+
+  std::atomic<int> Refs{2};
+
+  void release() {
+    if (--Refs == 0)
+      delete this;
+  }
+
+  // Blocks until the compile and its callback have finished and returns
+  // whether the compile succeeded.  Called from the callback itself, it
+  // returns at once instead of waiting for itself.
+  bool wait() {
+    std::unique_lock<std::mutex> Guard(Lock);
+    if (Compiled && CallbackThread == std::this_thread::get_id())
+      return Ok;
+    Finished.wait(Guard, [this]() { return Done; });
+    return Ok;
+  }
+
+  bool isDone() {
+    std::lock_guard<std::mutex> Guard(Lock);
+    return Done;
+  }
+};
+
+/// A fixed set of worker threads, each compiling in its own session set up
+/// like a template session (builtins, compile cache and options), fed from a
+/// bounded queue.  submit() blocks while the queue is full.  Destroying the
+/// pool finishes the work already queued.
+class CompilePool {
+public:
+  CompilePool(const Session &Template, unsigned NumThreads, size_t QueueLimit)
+    : Template(&Template), QueueLimit(std::max<size_t>(1, QueueLimit)) {
+    NumThreads = std::max(1u, NumThreads);
+    for (unsigned i = 0; i != NumThreads; ++i) {
+      Sessions.emplace_back(new Session());
+      Sessions.back()->inherit(Template);
+    }
+    for (unsigned i = 0; i != NumThreads; ++i)
+      Threads.emplace_back(&CompilePool::work, this, std::ref(*Sessions[i]));
+  }
+
+  ~CompilePool() {
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      Stopping = true;
+    }
+    NotEmpty.notify_all();
+    for (std::thread &T : Threads)
+      T.join();
+  }
+
+  // The session the workers were set up from.
+  const Session *getTemplate() const { return Template; }
+
+  void submit(CompileTicket *T) {
+    std::unique_lock<std::mutex> Guard(Lock);
+    NotFull.wait(Guard, [this]() { return Queue.size() < QueueLimit; });
+    Queue.push_back(T);
+    Guard.unlock();
+    NotEmpty.notify_one();
+  }
+
+private:
+  void work(Session &S) {
+    for (;;) {
+      CompileTicket *T;
+      {
+        std::unique_lock<std::mutex> Guard(Lock);
+        NotEmpty.wait(Guard, [this]() { return Stopping || !Queue.empty(); });
+        if (Queue.empty())
+          return;
+        T = Queue.front();
+        Queue.pop_front();
+      }
+      NotFull.notify_one();
+
+      bool Ok = CompilePipeline(S, T->Input.data(), T->Input.size(),
+                                T->OptLevel, T->SizeLevel, T->Flags, T->Out);
+      {
+        std::lock_guard<std::mutex> Guard(T->Lock);
+        T->Ok = Ok;
+        T->Compiled = true;
+        T->CallbackThread = std::this_thread::get_id();
+      }
+      // Waiters are woken only once Fn has returned, so a caller that frees
+      // what Opaque points to after waiting can't pull it from under Fn.
+      if (T->Fn)
+        T->Fn(T->Opaque, T, Ok);
+      {
+        std::lock_guard<std::mutex> Guard(T->Lock);
+        T->Done = true;
+      }
+      T->Finished.notify_all();
+      T->release();
+    }
+  }
+
+  const Session *Template;
+  size_t QueueLimit;
+  std::vector<std::unique_ptr<Session>> Sessions;
+  std::vector<std::thread> Threads;
+  std::mutex Lock;
+  std::condition_variable NotEmpty;
+  std::condition_variable NotFull;
+  std::deque<CompileTicket *> Queue;
+  bool Stopping = false;
+};
+
+// The pool behind HLC_CompileAsync, created on first use from TheSession.
+static std::mutex DefaultCompilePoolLock;
+static CompilePool *DefaultCompilePool = nullptr;
+
+static CompilePool &GetDefaultCompilePool() {
+  std::lock_guard<std::mutex> Guard(DefaultCompilePoolLock);
+  if (!DefaultCompilePool) {
+    unsigned NumThreads = std::max(1u, std::thread::hardware_concurrency());
+    DefaultCompilePool = new CompilePool(*TheSession, NumThreads,
+                                         4 * NumThreads);
+  }
+  return *DefaultCompilePool;
+}
+
+static void ShutdownDefaultCompilePool() {
+  std::lock_guard<std::mutex> Guard(DefaultCompilePoolLock);
+  delete DefaultCompilePool;
+  DefaultCompilePool = nullptr;
+}
+
+// Queues a compile of Input on Pool and returns its ticket.
+static CompileTicket *SubmitCompile(CompilePool &Pool, const char *Input,
+                                    size_t Len, int OptLevel, int SizeLevel,
+                                    unsigned Flags, CompileCallback Fn,
+                                    void *Opaque) {
+  const unsigned char *Ptr = reinterpret_cast<const unsigned char *>(Input);
+  CompileTicket *T = new CompileTicket();
+  if (isBitcode(Ptr, Ptr + Len))
+    T->Input.assign(Input, Len);
+  else
+    T->Input = Input;
+  T->OptLevel = OptLevel;
+  T->SizeLevel = SizeLevel;
+  T->Flags = Flags;
+  T->Fn = Fn;
+  T->Opaque = Opaque;
+  Pool.submit(T);
+  return T;
+}
+
+} // end libHLC namespace
+
+extern "C" {
+
+using namespace libHLC;
+
+typedef struct OpaqueModule* llvm_module_ptr;
+
+void HLC_Initialize() {
+  Initialize();
+}
+
+void HLC_Finalize() {
+  Finalize();
+}
+
+
+char* HLC_CreateString(const char *str) {
+    return strdup(str);
+}
+
+void HLC_DisposeString(char *str) {
+  free(str);
+}
+
+Session* HLC_CreateSession() {
+  return new Session();
+}
+
+// Destroys every module parsed in S and every scoped output at once.  Module
+// handles and scoped outputs from S must not be used afterwards.
+void HLC_SessionReset(Session *S) {
+  S->reset();
+}
+
+// Also destroys the modules still alive in S, like HLC_SessionReset.
+void HLC_DestroySession(Session *S) {
+  delete S;
+}
+
+ModuleRef* HLC_SessionParseModule(Session *S, const char *Asm) {
+  return S->adopt(ParseInSession(*S, Asm, 0, ParseAssembly));
+}
+
+ModuleRef* HLC_SessionParseBitcode(Session *S, const char *Asm, size_t Len) {
+  return S->adopt(ParseInSession(*S, Asm, Len, ParseBitcode));
+}
+
+ModuleRef* HLC_SessionParseBitcodeLazy(Session *S, const char *Asm,
+                                       size_t Len) {
+  return S->adopt(ParseInSession(*S, Asm, Len, ParseBitcodeLazy));
+}
+
+// Like HLC_SessionParseBitcodeLazy but without copying the bitcode: Bitcode
+// must stay valid and unchanged until the module is destroyed.
+ModuleRef* HLC_SessionParseBitcodeBorrowed(Session *S, const char *Bitcode,
+                                           size_t Len) {
+  return S->adopt(ParseInSession(*S, Bitcode, Len, ParseBitcodeBorrowed));
+}
+
+// Reports the parses S has done in Format so far (0: assembly, 1: bitcode,
+// 2: lazy bitcode, 3: borrowed lazy bitcode), to compare
+// the cost of textual IR against the bitcode paths.
+int HLC_SessionGetParseStats(Session *S, int Format, size_t *Count,
+                             size_t *Bytes, double *Seconds) {
+  if (Format < 0 || Format >= NumParseModes) return 0;
+  const ParseTotals &Totals = S->getParseTotals(ParseMode(Format));
+  *Count = Totals.Count;
+  *Bytes = Totals.Bytes;
+  *Seconds = Totals.Seconds;
+  return 1;
+}
+
+ModuleRef* HLC_ParseModule(const char *Asm) {
+  return HLC_SessionParseModule(TheSession, Asm);
+}
+
+ModuleRef* HLC_ParseBitcode(const char *Asm, size_t Len) {
+  return HLC_SessionParseBitcode(TheSession, Asm, Len);
+}
+
+ModuleRef* HLC_ParseBitcodeLazy(const char *Asm, size_t Len) {
+  return HLC_SessionParseBitcodeLazy(TheSession, Asm, Len);
+}
+
+ModuleRef* HLC_ParseBitcodeBorrowed(const char *Bitcode, size_t Len) {
+  return HLC_SessionParseBitcodeBorrowed(TheSession, Bitcode, Len);
+}
+
+// ModuleRef* HLC_ParseBitcodeFile(const char *Asm, size_t Len) {
+  // return ModuleRef::parseBitcode(Asm, Len);
+// }
+
+void HLC_ModulePrint(ModuleRef *M, char **output) {
+  *output = HLC_CreateString(M->to_string().c_str());
+}
+
+// Takes a snapshot of the functions and globals of M.  With Materialize, lazy
+// bodies are read to count their blocks and instructions; otherwise functions
+// whose bodies haven't been read report -1 for both.  Release with
+// HLC_DestroyModuleInfo.
+ModuleInfo* HLC_ModuleGetInfo(ModuleRef *M, int Materialize) {
+  if (Materialize && !M->materialize()) return nullptr;
+  return new ModuleInfo(*M->get());
+}
+
+size_t HLC_ModuleInfoNumFunctions(ModuleInfo *Info) {
+  return Info->functions().size();
+}
+
+// Returns function I in module order, or null past the end.
+const FunctionInfo* HLC_ModuleInfoGetFunction(ModuleInfo *Info, size_t I) {
+  if (I >= Info->functions().size()) return nullptr;
+  return &Info->functions()[I];
+}
+
+size_t HLC_ModuleInfoNumGlobals(ModuleInfo *Info) {
+  return Info->globals().size();
+}
+
+// Returns global variable I in module order, or null past the end.
+const GlobalInfo* HLC_ModuleInfoGetGlobal(ModuleInfo *Info, size_t I) {
+  if (I >= Info->globals().size()) return nullptr;
+  return &Info->globals()[I];
+}
+
+void HLC_DestroyModuleInfo(ModuleInfo *Info) {
+  delete Info;
+}
+
+// Returns an independent copy of M in the same context and session, e.g. to
+// optimize one linked module at several levels.  Lazy bodies are read first.
+ModuleRef* HLC_ModuleClone(ModuleRef *M) {
+  if (!M->materialize()) return nullptr;
+  ModuleRef *Clone = new ModuleRef(CloneModule(M->get()));
+  if (Session *S = M->getOwner())
+    S->adopt(Clone);
+  return Clone;
+}
+
+// Keeps only the Count functions named in Entries as externally visible and
+// removes the code they don't use.  With Count == 0 the kernels are kept.
+// Returns 0, leaving M as it is, if none of them is defined in M.
+int HLC_ModuleStripDead(ModuleRef *M, const char * const *Entries,
+                        size_t Count) {
+  if (!M->materialize()) return 0;
+  return StripDeadCode(M->get(), makeArrayRef(Entries, Count));
+}
+
+// Profile hooks.  Apply them after HLC_LinkBuiltins, so that the linked
+// builtin bodies are affected too, and before optimizing.  Blocks are given
+// by their index in function order.  Each returns 1 on success and 0 if the
+// function or block doesn't exist or doesn't fit the data.
+
+// Marks the function Name hot (Hotness > 0) or cold (Hotness < 0); see
+// SetFunctionHotness.  Zero leaves it as it is.  Mark the cold functions
+// first: a hot caller only passes its inline hint on to callees with no cold
+// callers at the time.
+int HLC_ModuleSetFunctionHotness(ModuleRef *M, const char *Name,
+                                 int Hotness) {
+  if (!M->materialize()) return 0;
+  Function *F = M->get()->getFunction(Name);
+  if (!F || F->isDeclaration()) return 0;
+  SetFunctionHotness(F, Hotness);
+  return 1;
+}
+
+// Attaches branch_weights profile metadata, one weight per successor, to
+// the terminator of block Block of FunctionName.
+int HLC_ModuleSetBranchWeights(ModuleRef *M, const char *FunctionName,
+                               unsigned Block, const unsigned *Weights,
+                               size_t Count) {
+  if (!M->materialize()) return 0;
+  BasicBlock *BB = GetBlock(M->get(), FunctionName, Block);
+  if (!BB) return 0;
+  std::vector<uint32_t> W(Weights, Weights + Count);
+  return SetBranchWeights(BB, W);
+}
+
+// Sets the unroll count of the loop whose header is block Header of
+// FunctionName, e.g. from its profiled trip count.  A count of 1 keeps the loop
+// rolled.
+int HLC_ModuleSetLoopUnrollCount(ModuleRef *M, const char *FunctionName,
+                                 unsigned Header, unsigned Count) {
+  if (Count == 0) return 0;
+  if (!M->materialize()) return 0;
+  BasicBlock *BB = GetBlock(M->get(), FunctionName, Header);
+  if (!BB) return 0;
+  return SetLoopUnrollCount(BB, Count);
+}
+
+void HLC_ModuleDestroy(ModuleRef *M) {
+  if (Session *S = M->getOwner())
+    S->release(M);
+  M->destroy();
+  delete M;
+}
+
+int HLC_SessionModuleOptimize(Session *S, ModuleRef *M, int OptLevel,
+                              int SizeLevel, int Verify) {
+  if (OptLevel < 0 || OptLevel > 3) return 0;
+  if (SizeLevel < 0 || SizeLevel > 2) return 0;
+  if (!S->owns(M)) return 0;
+  Optimize(*S, M->get(), OptLevel, SizeLevel, Verify);
+  return 1;
+}
+
+int HLC_ModuleOptimize(ModuleRef *M, int OptLevel, int SizeLevel, int Verify) {
+  return HLC_SessionModuleOptimize(TheSession, M, OptLevel, SizeLevel, Verify);
+}
+
+// Runs a custom pipeline instead of the OptLevel one, e.g.
+// "mem2reg,instcombine,simplifycfg,gvn" for kernels that need little more.
+// See RunNamedPasses for the format.
+int HLC_SessionModuleRunPasses(Session *S, ModuleRef *M,
+                               const char *Pipeline) {
+  if (!S->owns(M)) return 0;
+  if (!M->materialize()) return 0;
+  return RunNamedPasses(*S, M->get(), Pipeline);
+}
+
+int HLC_ModuleRunPasses(ModuleRef *M, const char *Pipeline) {
+  Session *S = M->getOwner() ? M->getOwner() : TheSession;
+  return HLC_SessionModuleRunPasses(S, M, Pipeline);
+}
+
+int HLC_SessionModuleLinkIn(Session *S, ModuleRef *Dst, ModuleRef *Src) {
+  // Both modules must live in the session's context.
+  if (!S->owns(Dst) || !S->owns(Src)) return 0;
+  // A lazy source only has the bodies the linker pulls in read, but the
+  // destination has to be complete.
+  if (!Dst->materialize()) return 0;
+  PhaseTimer Timer(S->getStats().LinkSeconds);
+  return !llvm::Linker::LinkModules(Dst->get(), Src->get());
+}
+
+int HLC_ModuleLinkIn(ModuleRef *Dst, ModuleRef *Src) {
+  return HLC_SessionModuleLinkIn(TheSession, Dst, Src);
+}
+
+int HLC_SessionLoadBuiltins(Session *S, const char *Bitcode, size_t Len) {
+  return S->loadBuiltins(Bitcode, Len);
+}
+
+int HLC_SessionLinkBuiltins(Session *S, ModuleRef *M) {
+  if (!S->owns(M)) return 0;
+  if (!M->materialize()) return 0;
+  return S->linkBuiltins(M->get());
+}
+
+// Links the builtins into M using M's session, which starts out with the
+// builtins embedded in libHLC.
+int HLC_LinkBuiltins(ModuleRef *M) {
+  Session *S = M->getOwner() ? M->getOwner() : TheSession;
+  return HLC_SessionLinkBuiltins(S, M);
+}
+
+int HLC_SessionModuleEmitHSAIL(Session *S, ModuleRef *M, int OptLevel,
+                               char **output) {
+  // Compile straight into the buffer that is handed back
+  MallocStream os;
+  if (!EmitModule(*S, M, false, OptLevel, os)) return 0;
+  size_t Len;
+  *output = os.release(Len);
+  return 1;
+}
+
+int HLC_ModuleEmitHSAIL(ModuleRef *M, int OptLevel, char **output) {
+  return HLC_SessionModuleEmitHSAIL(TheSession, M, OptLevel, output);
+}
+
+size_t HLC_SessionModuleEmitBRIG(Session *S, ModuleRef *M, int OptLevel,
+                                 char **output) {
+  // Compile straight into the buffer that is handed back
+  MallocStream os;
+  if (!EmitModule(*S, M, true, OptLevel, os)) return 0;
+  size_t Len;
+  *output = os.release(Len);
+  return Len;
+}
+
+size_t HLC_ModuleEmitBRIG(ModuleRef *M, int OptLevel, char **output) {
+  return HLC_SessionModuleEmitBRIG(TheSession, M, OptLevel, output);
+}
+
+// The *Scoped variants return output owned by the session.  It stays valid
+// until HLC_SessionReset or HLC_DestroySession and is not freed by the caller.
+const char* HLC_SessionModulePrintScoped(Session *S, ModuleRef *M) {
+  return S->keepOutput(M->to_string());
+}
+
+int HLC_SessionModuleEmitHSAILScoped(Session *S, ModuleRef *M, int OptLevel,
+                                     const char **output) {
+  SmallVectorImpl<char> &Scratch = S->getScratch();
+  Scratch.clear();
+  raw_svector_ostream os(Scratch);
+  if (!EmitModule(*S, M, false, OptLevel, os)) return 0;
+  *output = S->keepOutput(os.str());
+  return 1;
+}
+
+size_t HLC_SessionModuleEmitBRIGScoped(Session *S, ModuleRef *M, int OptLevel,
+                                       const char **output) {
+  SmallVectorImpl<char> &Scratch = S->getScratch();
+  Scratch.clear();
+  raw_svector_ostream os(Scratch);
+  if (!EmitModule(*S, M, true, OptLevel, os)) return 0;
+  StringRef Data = os.str();
+  *output = S->keepOutput(Data);
+  return Data.size();
+}
+
+// The *ToBuffer variants write into Buffer and return the full output size
+// (no NUL terminator is added).  If that exceeds Capacity, only the first
+// Capacity bytes were stored.  Zero means the compile failed.
+size_t HLC_SessionModuleEmitHSAILToBuffer(Session *S, ModuleRef *M,
+                                          int OptLevel, char *Buffer,
+                                          size_t Capacity) {
+  BufferStream os(Buffer, Capacity);
+  return EmitModule(*S, M, false, OptLevel, os);
+}
+
+size_t HLC_SessionModuleEmitBRIGToBuffer(Session *S, ModuleRef *M,
+                                         int OptLevel, char *Buffer,
+                                         size_t Capacity) {
+  BufferStream os(Buffer, Capacity);
+  return EmitModule(*S, M, true, OptLevel, os);
+}
+
+// The *ToCallback variants pass the output to Fn as it is produced and return
+// its total size, or zero on failure.
+size_t HLC_SessionModuleEmitHSAILToCallback(Session *S, ModuleRef *M,
+                                            int OptLevel, WriteCallback Fn,
+                                            void *Opaque) {
+  CallbackStream os(Fn, Opaque);
+  return EmitModule(*S, M, false, OptLevel, os);
+}
+
+size_t HLC_SessionModuleEmitBRIGToCallback(Session *S, ModuleRef *M,
+                                           int OptLevel, WriteCallback Fn,
+                                           void *Opaque) {
+  CallbackStream os(Fn, Opaque);
+  return EmitModule(*S, M, true, OptLevel, os);
+}
+
+// The *ToFD variants write to an open file descriptor (left open) and the
+// *ToPath variants replace the file at Path.  Both stream the output instead
+// of collecting it in memory, and return its size, or zero on failure.
+size_t HLC_SessionModuleEmitHSAILToFD(Session *S, ModuleRef *M, int OptLevel,
+                                      int FD) {
+  return EmitModuleToFD(*S, M, false, OptLevel, FD);
+}
+
+size_t HLC_SessionModuleEmitBRIGToFD(Session *S, ModuleRef *M, int OptLevel,
+                                     int FD) {
+  return EmitModuleToFD(*S, M, true, OptLevel, FD);
+}
+
+size_t HLC_SessionModuleEmitHSAILToPath(Session *S, ModuleRef *M,
+                                        int OptLevel, const char *Path) {
+  return EmitModuleToPath(*S, M, false, OptLevel, Path);
+}
+
+size_t HLC_SessionModuleEmitBRIGToPath(Session *S, ModuleRef *M, int OptLevel,
+                                       const char *Path) {
+  return EmitModuleToPath(*S, M, true, OptLevel, Path);
+}
+
+// Writes M as bitcode, which HLC_ParseBitcode reads back much faster than
+// HLC_ParseModule reads the printed text.  Output receives a malloc'd buffer
+// released with HLC_DisposeString.  Returns its size, or zero on failure.
+size_t HLC_ModuleEmitBitcode(ModuleRef *M, char **output) {
+  MallocStream os;
+  if (!WriteModuleBitcode(M, os)) return 0;
+  size_t Len;
+  *output = os.release(Len);
+  return Len;
+}
+
+// Like the *ToBuffer emit variants: returns the full bitcode size, of which
+// only the first Capacity bytes were stored if it is larger.
+size_t HLC_ModuleEmitBitcodeToBuffer(ModuleRef *M, char *Buffer,
+                                     size_t Capacity) {
+  BufferStream os(Buffer, Capacity);
+  return WriteModuleBitcode(M, os);
+}
+
+size_t HLC_ModuleEmitBitcodeToCallback(ModuleRef *M, WriteCallback Fn,
+                                       void *Opaque) {
+  CallbackStream os(Fn, Opaque);
+  return WriteModuleBitcode(M, os);
+}
+
+/// One kernel's output from HLC_SessionModuleEmitKernelBRIGs.  C layout.
+struct KernelBRIG {
+  char *Name;
+  char *BRIG;
+  size_t BRIGSize;
+};
+
+// Splits M into one module per kernel and generates their BRIG on up to
+// NumThreads threads, leaving M as it is.  *Kernels receives one entry per
+// kernel in module order, released with HLC_DisposeKernelBRIGs.  Returns the
+// number of kernels, or zero on failure or if M can't be split (see
+// SplitByKernel); HLC_SessionModuleEmitBRIG still handles such modules.
+size_t HLC_SessionModuleEmitKernelBRIGs(Session *S, ModuleRef *M,
+                                        int OptLevel, int NumThreads,
+                                        KernelBRIG **Kernels) {
+  if (OptLevel < 0 || OptLevel > 3) return 0;
+  if (!S->owns(M)) return 0;
+
+  std::vector<std::string> Names;
+  KernelJob Job;
+  if (!SplitByKernel(M->get(), Names, Job.Parts)) {
+    errs() << "module cannot be split by kernel\n";
+    return 0;
+  }
+  size_t Count = Job.Parts.size();
+  Job.OptLevel = OptLevel;
+  Job.Outputs.reset(new CompileOutput[Count]);
+  Job.Ok.reset(new bool[Count]());
+  Job.Next = 0;
+  if (!CompileKernels(*S, Job, NumThreads > 0 ? NumThreads : 1))
+    return 0;
+
+  KernelBRIG *Result = (KernelBRIG *)malloc(Count * sizeof(KernelBRIG));
+  for (size_t i = 0; i != Count; ++i) {
+    Result[i].Name = HLC_CreateString(Names[i].c_str());
+    Result[i].BRIG = Job.Outputs[i].BRIG;
+    Result[i].BRIGSize = Job.Outputs[i].BRIGSize;
+    Job.Outputs[i].BRIG = nullptr;
+  }
+  *Kernels = Result;
+  return Count;
+}
+
+void HLC_DisposeKernelBRIGs(KernelBRIG *Kernels, size_t Count) {
+  for (size_t i = 0; i != Count; ++i) {
+    free(Kernels[i].Name);
+    free(Kernels[i].BRIG);
+  }
+  free(Kernels);
+}
+
+// Compiles Input (bitcode or NUL-terminated assembly) to the formats selected
+// by Flags (see CompileFlags).  HSAIL and BRIG receive malloc'd buffers that
+// are released with HLC_DisposeString; they may be null when not requested.
+int HLC_SessionCompile(Session *S, const char *Input, size_t Len, int OptLevel,
+                       int SizeLevel, int Flags, char **HSAIL, char **BRIG,
+                       size_t *BRIGSize) {
+  CompileOutput Out;
+  if (!CompilePipeline(*S, Input, Len, OptLevel, SizeLevel, Flags, Out))
+    return 0;
+  if (HSAIL) {
+    *HSAIL = Out.HSAIL;
+    Out.HSAIL = nullptr;
+  }
+  if (BRIG) {
+    *BRIG = Out.BRIG;
+    *BRIGSize = Out.BRIGSize;
+    Out.BRIG = nullptr;
+  }
+  return 1;
+}
+
+// Compiles Count inputs as HLC_SessionCompile would, on up to NumThreads
+// threads.  Slot i of HSAILs, BRIGs and BRIGSizes receives the result for
+// Inputs[i] (null on failure); any of the arrays may be null when that output
+// isn't wanted.  Returns the number of inputs that compiled.
+size_t HLC_SessionCompileBatch(Session *S, size_t Count,
+                               const char *const *Inputs, const size_t *Lens,
+                               int OptLevel, int SizeLevel, int Flags,
+                               int NumThreads, char **HSAILs, char **BRIGs,
+                               size_t *BRIGSizes) {
+  BatchJob Job;
+  Job.Inputs = Inputs;
+  Job.Lens = Lens;
+  Job.OptLevel = OptLevel;
+  Job.SizeLevel = SizeLevel;
+  Job.Flags = Flags;
+  Job.Count = Count;
+  Job.Outputs.reset(new CompileOutput[Count]);
+  Job.Ok.reset(new bool[Count]());
+  Job.Next = 0;
+  CompileBatch(*S, Job, NumThreads > 0 ? NumThreads : 1);
+
+  size_t Compiled = 0;
+  for (size_t i = 0; i != Count; ++i) {
+    CompileOutput &Out = Job.Outputs[i];
+    if (!Job.Ok[i]) {
+      if (HSAILs) HSAILs[i] = nullptr;
+      if (BRIGs) BRIGs[i] = nullptr;
+      if (BRIGSizes) BRIGSizes[i] = 0;
+      continue;
+    }
+    ++Compiled;
+    if (BRIGSizes)
+      BRIGSizes[i] = Out.BRIGSize;
+    if (HSAILs) {
+      HSAILs[i] = Out.HSAIL;
+      Out.HSAIL = nullptr;
+    }
+    if (BRIGs) {
+      BRIGs[i] = Out.BRIG;
+      Out.BRIG = nullptr;
+    }
+  }
+  return Compiled;
+}
+
+size_t HLC_CompileBatch(size_t Count, const char *const *Inputs,
+                        const size_t *Lens, int OptLevel, int SizeLevel,
+                        int Flags, int NumThreads, char **HSAILs,
+                        char **BRIGs, size_t *BRIGSizes) {
+  return HLC_SessionCompileBatch(TheSession, Count, Inputs, Lens, OptLevel,
+                                 SizeLevel, Flags, NumThreads, HSAILs, BRIGs,
+                                 BRIGSizes);
+}
+
+// Creates a pipeline that optimizes modules of S like HLC_SessionModuleOptimize
+// at the given levels, without repeating the setup on every call.  Flags are
+// OptPipelineFlags.  Destroy it before the session.
+OptPipeline* HLC_SessionCreateOptPipeline(Session *S, int OptLevel,
+                                          int SizeLevel, int Flags) {
+  if (OptLevel < 0 || OptLevel > 3) return nullptr;
+  if (SizeLevel < 0 || SizeLevel > 2) return nullptr;
+  return new OptPipeline(*S, OptLevel, SizeLevel, Flags & OptPipelineVerify);
+}
+
+OptPipeline* HLC_CreateOptPipeline(int OptLevel, int SizeLevel, int Flags) {
+  return HLC_SessionCreateOptPipeline(TheSession, OptLevel, SizeLevel, Flags);
+}
+
+int HLC_OptPipelineRun(OptPipeline *P, ModuleRef *M) {
+  if (!P->getSession().owns(M)) return 0;
+  P->run(M->get());
+  return 1;
+}
+
+void HLC_DestroyOptPipeline(OptPipeline *P) {
+  delete P;
+}
+
+// Fills Options with the global defaults, with no CPU or features.
+void HLC_InitCompileOptions(CompileOptions *Options) {
+  Options->DisableInline = DisableInline;
+  Options->UnitAtATime = UnitAtATime;
+  Options->DisableLoopVectorization = DisableLoopVectorization;
+  Options->DisableSLPVectorization = DisableSLPVectorization;
+  Options->DisableSimplifyLibCalls = DisableSimplifyLibCalls;
+  Options->CPU = nullptr;
+  Options->Features = nullptr;
+}
+
+// Makes later compiles in S use Options instead of the global flags and
+// HLC_SetCommandLineOption's -mcpu/-mattr, so differently tuned sessions can
+// compile concurrently.  The strings are copied.  Null restores the globals.
+void HLC_SessionSetCompileOptions(Session *S, const CompileOptions *Options) {
+  if (!Options) {
+    S->setOptions(nullptr);
+    return;
+  }
+  SessionOptions O = SessionOptions::fromC(*Options);
+  S->setOptions(&O);
+}
+
+// Makes S remember up to MaxEntries optimized partitions, one per kernel or
+// other external function with everything it calls, so that recompiling a
+// module only optimizes the partitions that changed.  Zero turns it off.
+void HLC_SessionSetIncremental(Session *S, size_t MaxEntries) {
+  S->setIncremental(MaxEntries);
+}
+
+void HLC_SessionGetIncrementalStats(Session *S, size_t *Hits,
+                                    size_t *Misses) {
+  PartitionCache *Cache = S->getPartitionCache();
+  *Hits = Cache ? Cache->hits() : 0;
+  *Misses = Cache ? Cache->misses() : 0;
+}
+
+// Starts a pool of NumThreads compile threads.  Each works in its own session
+// with S's builtins, compile cache and options as of this call.  At most
+// QueueLimit compiles wait to be picked up; further submissions block.
+CompilePool* HLC_CreateCompilePool(Session *S, int NumThreads,
+                                   int QueueLimit) {
+  if (NumThreads < 1 || QueueLimit < 1) return nullptr;
+  return new CompilePool(*S, NumThreads, QueueLimit);
+}
+
+// Waits for the queued compiles to finish, then stops the threads.
+void HLC_DestroyCompilePool(CompilePool *Pool) {
+  delete Pool;
+}
+
+// Queues a compile as HLC_SessionCompile would do it and returns at once.
+// Input is copied.  Fn, if given, is called on the pool thread when the
+// compile is done; the ticket is still valid then, and Fn may take the
+// result with HLC_TicketGetResult.  The ticket only counts as done once Fn
+// has returned, so Opaque has to stay valid until HLC_TicketWait or
+// HLC_TicketGetResult returns, or HLC_TicketIsDone reports 1.  Release every
+// ticket with HLC_TicketRelease.
+CompileTicket* HLC_CompilePoolSubmit(CompilePool *Pool, const char *Input,
+                                     size_t Len, int OptLevel, int SizeLevel,
+                                     int Flags, CompileCallback Fn,
+                                     void *Opaque) {
+  return SubmitCompile(*Pool, Input, Len, OptLevel, SizeLevel, Flags, Fn,
+                       Opaque);
+}
+
+// HLC_CompilePoolSubmit on a default pool set up from the default session,
+// with one thread per core.
+CompileTicket* HLC_CompileAsync(const char *Input, size_t Len, int OptLevel,
+                                int SizeLevel, int Flags, CompileCallback Fn,
+                                void *Opaque) {
+  return SubmitCompile(GetDefaultCompilePool(), Input, Len, OptLevel,
+                       SizeLevel, Flags, Fn, Opaque);
+}
+
+// Tiered compile for low startup latency: compiles Input at O0 into HSAIL
+// and BRIG as HLC_SessionCompile would, then queues the same compile at
+// OptLevel and SizeLevel on Pool and returns that ticket.  Fn signals when the
+// optimized binary is ready to be swapped in.  Pool must have been created
+// from S, so both tiers see the same builtins, options, cache and budget (as
+// they were when the pool was created).  Returns null, queuing nothing, if
+// the pool is from another session or the O0 compile fails.
+CompileTicket* HLC_SessionCompileTiered(Session *S, CompilePool *Pool,
+                                        const char *Input, size_t Len,
+                                        int OptLevel, int SizeLevel,
+                                        int Flags, char **HSAIL, char **BRIG,
+                                        size_t *BRIGSize, CompileCallback Fn,
+                                        void *Opaque) {
+  if (!Pool || Pool->getTemplate() != S) return nullptr;
+  if (!HLC_SessionCompile(S, Input, Len, 0, 0, Flags, HSAIL, BRIG, BRIGSize))
+    return nullptr;
+  return SubmitCompile(*Pool, Input, Len, OptLevel, SizeLevel, Flags, Fn,
+                       Opaque);
+}
+
+// HLC_SessionCompileTiered in the default session, with the optimized tier
+// on the default pool, which is set up from the default session.
+CompileTicket* HLC_CompileTiered(const char *Input, size_t Len, int OptLevel,
+                                 int SizeLevel, int Flags, char **HSAIL,
+                                 char **BRIG, size_t *BRIGSize,
+                                 CompileCallback Fn, void *Opaque) {
+  return HLC_SessionCompileTiered(TheSession, &GetDefaultCompilePool(), Input,
+                                  Len, OptLevel, SizeLevel, Flags, HSAIL,
+                                  BRIG, BRIGSize, Fn, Opaque);
+}
+
+int HLC_TicketIsDone(CompileTicket *T) {
+  return T->isDone();
+}
+
+// Blocks until the compile is done.  Returns 1 if it succeeded.
+int HLC_TicketWait(CompileTicket *T) {
+  return T->wait();
+}
+
+// Waits for the compile and hands over its outputs like HLC_SessionCompile.
+// Each output can only be taken once.
+int HLC_TicketGetResult(CompileTicket *T, char **HSAIL, char **BRIG,
+                        size_t *BRIGSize) {
+  if (!T->wait()) return 0;
+  std::lock_guard<std::mutex> Guard(T->Lock);
+  if (HSAIL) {
+    *HSAIL = T->Out.HSAIL;
+    T->Out.HSAIL = nullptr;
+  }
+  if (BRIG) {
+    *BRIG = T->Out.BRIG;
+    *BRIGSize = T->Out.BRIGSize;
+    T->Out.BRIG = nullptr;
+  }
+  return 1;
+}
+
+// Drops the caller's reference.  A ticket may be released before its compile
+// finishes; the result is then discarded.
+void HLC_TicketRelease(CompileTicket *T) {
+  T->release();
+}
+
+void HLC_SessionGetLastCompileStats(Session *S, CompileStats *Stats) {
+  *Stats = S->getStats();
+}
+
+void HLC_GetLastCompileStats(CompileStats *Stats) {
+  HLC_SessionGetLastCompileStats(TheSession, Stats);
+}
+
+// Turns LLVM's per-pass timers on or off.  They are process-wide: with
+// concurrent sessions the report covers all of them.
+void HLC_EnablePassTiming(int Enable) {
+  TimePassesIsEnabled = Enable;
+}
+
+// Returns the pass timing report collected since the last call and resets
+// the timers.  Release with HLC_DisposeString.
+void HLC_GetPassTimingReport(char **output) {
+  MallocStream os;
+  TimerGroup::printAll(os);
+  size_t Len;
+  *output = os.release(Len);
+}
+
+void HLC_SessionGetTargetMachineStats(Session *S, size_t *Hits,
+                                      size_t *Misses) {
+  *Hits = S->getTargetMachines().hits();
+  *Misses = S->getTargetMachines().misses();
+}
+
+// Sets soft limits on how much an Optimize() call may grow the process's
+// resident memory and how long it may run (zero for no limit).  A compile
+// that passes either winds its pipeline down at the next probe and is
+// optimized again from its input by a cheap pipeline (O1 without inlining or
+// unrolling); the stats report OptimizeFallback, and such output is never
+// put in the compile cache.  The memory figure is process-wide, so the
+// memory limit only applies while no other optimizer or codegen run is in
+// progress.  Modules with comdats are never stopped.
+void HLC_SessionSetCompileBudget(Session *S, size_t MaxBytes,
+                                 double MaxSeconds) {
+  S->setBudget(MaxBytes, MaxSeconds > 0 ? MaxSeconds : 0);
+}
+
+// Returns the highest OptimizePeakBytes of any compile in the session.  Like
+// that figure it is the process's resident memory growth, including other
+// threads' allocations.
+size_t HLC_SessionGetPeakMemory(Session *S) {
+  return S->getPeakBytes();
+}
+
+// Enables the on-disk cache used by HLC_SessionCompile, stored in Dir and kept
+// under MaxBytes (zero for no limit).  A null or empty Dir disables it.
+void HLC_SessionSetCacheDirectory(Session *S, const char *Dir,
+                                  size_t MaxBytes) {
+  S->setCache(Dir ? Dir : "", MaxBytes);
 }
 
 void HLC_SetCommandLineOption(int argc, const char * const * argv){
-   llvm::cl::ParseCommandLineOptions(argc, argv, nullptr);
+   {
+     std::lock_guard<std::mutex> Guard(CommandLineLock);
+     llvm::cl::ParseCommandLineOptions(argc, argv, nullptr);
+     for (int i = 0; i < argc; ++i) {
+       CommandLineState += argv[i];
+       CommandLineState += '\0';
+     }
+   }
+   ++CommandLineGeneration;
+   // Apply the float ABI here rather than in every CompileModule call so that
+   // concurrent compiles never write to the shared flag.
+   if (GenerateSoftFloatCalls)
+     FloatABIForCalls = FloatABI::Soft;
 }
 
 } // end extern "C"